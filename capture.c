@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "capture.h"
+#include "trace.h"
+#include "helper_funcs.h"
+
+bool capture_enabled = false;
+static int capture_fd = -1;
+static uint64_t capture_start;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+//Signalled when capture_full has records to write, or the server is stopping
+static pthread_cond_t capture_ready = PTHREAD_COND_INITIALIZER;
+//Signalled when capture_full has been written and can take the next buffer
+static pthread_cond_t capture_space = PTHREAD_COND_INITIALIZER;
+//Workers add records to capture_buffer, and the write thread writes out capture_full without
+//holding capture_mutex, so a disk write never blocks a worker until both buffers are full
+static char *capture_buffer;
+static size_t capture_used;
+static char *capture_full;
+static size_t capture_full_used;
+static bool capture_stopping = false;
+
+//Caller holds capture_mutex, and capture_full is empty
+static void swap_buffers(void) {
+    char *full = capture_full;
+    capture_full = capture_buffer;
+    capture_full_used = capture_used;
+    capture_buffer = full;
+    capture_used = 0;
+}
+static void write_buffer(const char *buffer, size_t size) {
+    if (size > 0 && write_n_bytes(capture_fd, (char *) buffer, size) == -1) {
+        fprintf(stderr, "Failed to write capture: %s\n", strerror(errno));
+    }
+}
+static void *capture_write_thread(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&capture_mutex);
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (CAPTURE_FLUSH_MS % 1000) * 1000000;
+        deadline.tv_sec += CAPTURE_FLUSH_MS / 1000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (capture_full_used == 0 && !capture_stopping
+               && pthread_cond_timedwait(&capture_ready, &capture_mutex, &deadline) != ETIMEDOUT) {
+        }
+        //Nothing filled up in time, so write out what there is
+        if (capture_full_used == 0) {
+            swap_buffers();
+        }
+        pthread_mutex_unlock(&capture_mutex);
+        write_buffer(capture_full, capture_full_used);
+        pthread_mutex_lock(&capture_mutex);
+        capture_full_used = 0;
+        pthread_cond_broadcast(&capture_space);
+        if (capture_stopping) {
+            //Exit while holding the lock so no worker can add a half-written record
+            write_buffer(capture_buffer, capture_used);
+            fsync(capture_fd);
+            exit(0);
+        }
+    }
+    return NULL;
+}
+static void *capture_signal_thread(void *arg) {
+    sigset_t *set = (sigset_t *) arg;
+    int sig;
+    while (sigwait(set, &sig) != 0) {
+    }
+    pthread_mutex_lock(&capture_mutex);
+    capture_stopping = true;
+    pthread_cond_signal(&capture_ready);
+    pthread_mutex_unlock(&capture_mutex);
+    return NULL;
+}
+int capture_init(const char *path) {
+    static sigset_t set;
+    pthread_t thread;
+    capture_buffer = malloc(CAPTURE_BUFFER_SIZE);
+    capture_full = malloc(CAPTURE_BUFFER_SIZE);
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (capture_buffer == NULL || capture_full == NULL || capture_fd == -1) {
+        return -1;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    CaptureHeader header;
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    header.start_time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (write_n_bytes(capture_fd, (char *) &header, sizeof(header)) != sizeof(header)) {
+        return -1;
+    }
+    capture_start = trace_now();
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0
+        || pthread_create(&thread, NULL, capture_write_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    if (pthread_create(&thread, NULL, capture_signal_thread, &set) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    capture_enabled = true;
+    return 0;
+}
+void capture_request(uint64_t arrival, const char *method, const char *URI,
+    const char *request_id, size_t body_length, int status_code) {
+    uint64_t now = trace_now();
+    CaptureRecord record;
+    record.arrival_us = arrival > capture_start ? (arrival - capture_start) / 1000 : 0;
+    record.duration_us = now > arrival ? (now - arrival) / 1000 : 0;
+    record.request_id = request_id != NULL ? atoi(request_id) : 0;
+    record.body_length = body_length;
+    record.status_code = status_code;
+    record.method_length = strnlen(method, 8);
+    record.URI_length = strnlen(URI, 63);
+    size_t size = sizeof(record) + record.method_length + record.URI_length;
+    pthread_mutex_lock(&capture_mutex);
+    while (capture_used + size > CAPTURE_BUFFER_SIZE) {
+        if (capture_full_used == 0) {
+            swap_buffers();
+            pthread_cond_signal(&capture_ready);
+        } else {
+            //Both buffers are full; only happens if the disk falls behind
+            pthread_cond_wait(&capture_space, &capture_mutex);
+        }
+    }
+    char *p = capture_buffer + capture_used;
+    memcpy(p, &record, sizeof(record));
+    memcpy(p + sizeof(record), method, record.method_length);
+    memcpy(p + sizeof(record) + record.method_length, URI, record.URI_length);
+    capture_used += size;
+    pthread_mutex_unlock(&capture_mutex);
+}
+CaptureEntry *capture_load(const char *path, size_t *count, uint64_t *start_time) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    CaptureHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != CAPTURE_VERSION) {
+        fclose(file);
+        return NULL;
+    }
+    if (start_time != NULL) {
+        *start_time = header.start_time;
+    }
+    size_t capacity = 1024;
+    size_t n = 0;
+    CaptureEntry *entries = malloc(capacity * sizeof(CaptureEntry));
+    while (entries != NULL) {
+        CaptureEntry entry;
+        if (fread(&entry.record, sizeof(entry.record), 1, file) != 1
+            || entry.record.method_length > 8 || entry.record.URI_length > 63
+            || fread(entry.method, 1, entry.record.method_length, file)
+                   != entry.record.method_length
+            || fread(entry.URI, 1, entry.record.URI_length, file) != entry.record.URI_length) {
+            break;
+        }
+        entry.method[entry.record.method_length] = '\0';
+        entry.URI[entry.record.URI_length] = '\0';
+        if (n == capacity) {
+            capacity *= 2;
+            CaptureEntry *grown = realloc(entries, capacity * sizeof(CaptureEntry));
+            if (grown == NULL) {
+                break;
+            }
+            entries = grown;
+        }
+        entries[n++] = entry;
+    }
+    fclose(file);
+    *count = n;
+    return entries;
+}
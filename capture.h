@@ -0,0 +1,98 @@
+/**
+ * @File capture.h
+ *
+ * Optional traffic capture.  Every request that arrives from a client is
+ * appended to a compact binary file: a CaptureHeader followed by one
+ * CaptureRecord per request, in the order the requests completed.  The
+ * replay tool reads the file back with capture_load.  Fields are stored
+ * in host byte order.
+ *
+ * @author Brendan Lau
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "HCAP"
+#define CAPTURE_VERSION 1
+//Records are buffered in memory and written once this many bytes are waiting; there are two such
+//buffers, so workers fill one while the other is written
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+//Milliseconds between flushes of a partly filled buffer
+#define CAPTURE_FLUSH_MS 1000
+
+/** @struct CaptureHeader
+ *
+ *  @brief The start of a capture file.
+ */
+typedef struct CaptureHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t start_time; //Wall clock time capture_init was called, in nanoseconds
+} CaptureHeader;
+
+/** @struct CaptureRecord
+ *
+ *  @brief One request.  Followed in the file by method_length bytes of
+ *         method and URI_length bytes of URI, neither NUL terminated.
+ */
+typedef struct CaptureRecord {
+    uint64_t arrival_us; //Since capture_init; the connection's accept time
+    uint32_t duration_us; //From arrival until the response was sent
+    int32_t request_id;
+    uint32_t body_length; //The request's Content-Length
+    uint16_t status_code;
+    uint8_t method_length;
+    uint8_t URI_length;
+} CaptureRecord;
+
+/** @struct CaptureEntry
+ *
+ *  @brief A record as returned by capture_load, with its strings.
+ */
+typedef struct CaptureEntry {
+    CaptureRecord record;
+    char method[9];
+    char URI[64];
+} CaptureEntry;
+
+/** @brief Set by capture_init.
+ */
+extern bool capture_enabled;
+
+/** @brief Starts capturing to path, replacing any existing file, and
+ *         starts the thread that writes full buffers out and the
+ *         thread that waits for SIGINT and SIGTERM.  On
+ *         either signal the buffered records are written and the server
+ *         exits.  Every other thread must have both signals blocked, or
+ *         the kernel may deliver them there and kill the server without
+ *         a flush, so the caller blocks them before creating any thread,
+ *         including those started by other _init functions.
+ *
+ *  @return 0, indicating success, or -1, indicating that it failed.
+ */
+int capture_init(const char *path);
+
+/** @brief Appends one request to the capture.
+ *
+ *  @param arrival When the request arrived, from trace_now.
+ *
+ *  @param body_length The request's Content-Length.
+ */
+void capture_request(uint64_t arrival, const char *method, const char *URI,
+    const char *request_id, size_t body_length, int status_code);
+
+/** @brief Reads a capture file.
+ *
+ *  @param count Set to the number of entries.
+ *
+ *  @param start_time Set to the header's start_time, if not NULL.
+ *
+ *  @return An array of entries in file order, which the caller frees,
+ *          or NULL, if path is not a capture file.  A record cut off at
+ *          the end of the file is ignored.
+ */
+CaptureEntry *capture_load(const char *path, size_t *count, uint64_t *start_time);
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include "cluster.h"
+#include "ring.h"
+#include "helper_funcs.h"
+
+//Idle connections kept per peer
+#define CLUSTER_POOL_SIZE 8
+//Events taken from epoll at a time by the idle thread
+#define IDLE_EVENTS 64
+
+typedef struct Peer {
+    char host[256];
+    int port;
+    pthread_mutex_t mutex;
+    int idle[CLUSTER_POOL_SIZE];
+    uint64_t idle_since[CLUSTER_POOL_SIZE];
+    int num_idle;
+} Peer;
+
+//Forwarded connections between requests, watched by the idle thread
+typedef struct IdleSet {
+    //Guards the arrays; only the idle thread removes from them
+    pthread_mutex_t mutex;
+    int epoll_fd;
+    int *fds;
+    uint64_t *since;
+    int count;
+    int capacity;
+    void (*ready)(int socket);
+} IdleSet;
+
+bool cluster_enabled = false;
+static Peer *peers;
+static int num_peers;
+static int self_index;
+//Addresses allowed to send rebalance requests, besides loopback and this host
+static bool rebalance_enabled = false;
+static struct in_addr *trusted;
+static int num_trusted;
+static ring_t *cluster_ring;
+static IdleSet idle;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+int cluster_split_name(const char *name, char *host, size_t host_size) {
+    const char *colon = strrchr(name, ':');
+    if (colon == NULL || colon == name || (size_t) (colon - name) >= host_size) {
+        return -1;
+    }
+    int port = atoi(colon + 1);
+    if (port < 1 || port > 65535) {
+        return -1;
+    }
+    memcpy(host, name, colon - name);
+    host[colon - name] = '\0';
+    return port;
+}
+int cluster_parse_peers(char *list, char ***names) {
+    int count = 1;
+    for (char *c = list; *c != '\0'; c++) {
+        if (*c == ',') {
+            count++;
+        }
+    }
+    *names = calloc(count, sizeof(char *));
+    char host[256];
+    char *saveptr = NULL;
+    int i = 0;
+    for (char *name = strtok_r(list, ",", &saveptr); name != NULL;
+         name = strtok_r(NULL, ",", &saveptr)) {
+        if (cluster_split_name(name, host, sizeof(host)) == -1) {
+            free(*names);
+            *names = NULL;
+            return -1;
+        }
+        (*names)[i++] = name;
+    }
+    return i;
+}
+int cluster_init(char *peer_list, const char *self) {
+    char **names;
+    num_peers = cluster_parse_peers(peer_list, &names);
+    if (num_peers < 1) {
+        return -1;
+    }
+    self_index = -1;
+    peers = calloc(num_peers, sizeof(Peer));
+    for (int i = 0; i < num_peers; i++) {
+        peers[i].port = cluster_split_name(names[i], peers[i].host, sizeof(peers[i].host));
+        pthread_mutex_init(&peers[i].mutex, NULL);
+        if (strcmp(names[i], self) == 0) {
+            self_index = i;
+        }
+    }
+    cluster_ring = ring_new(names, num_peers, CLUSTER_VNODES);
+    free(names);
+    if (self_index == -1) {
+        return -1;
+    }
+    cluster_enabled = true;
+    return 0;
+}
+int cluster_owner(const char *URI) {
+    int owner = ring_lookup(cluster_ring, URI);
+    return owner == self_index ? -1 : owner;
+}
+static int trust_host(const char *host) {
+    struct addrinfo hints;
+    struct addrinfo *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+        return -1;
+    }
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        struct in_addr *grown = realloc(trusted, (num_trusted + 1) * sizeof(struct in_addr));
+        if (grown == NULL) {
+            freeaddrinfo(res);
+            return -1;
+        }
+        trusted = grown;
+        trusted[num_trusted++] = ((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+    }
+    freeaddrinfo(res);
+    return 0;
+}
+int cluster_rebalance_init(char *hosts) {
+    char *saveptr = NULL;
+    for (char *host = strtok_r(hosts, ",", &saveptr); host != NULL;
+         host = strtok_r(NULL, ",", &saveptr)) {
+        if (trust_host(host) == -1) {
+            return -1;
+        }
+    }
+    for (int i = 0; cluster_enabled && i < num_peers; i++) {
+        if (trust_host(peers[i].host) == -1) {
+            return -1;
+        }
+    }
+    rebalance_enabled = true;
+    return 0;
+}
+bool cluster_rebalance_allowed(int socket) {
+    struct sockaddr_in from;
+    struct sockaddr_in local;
+    socklen_t from_length = sizeof(from);
+    socklen_t local_length = sizeof(local);
+    if (!rebalance_enabled || getpeername(socket, (struct sockaddr *) &from, &from_length) == -1
+        || from.sin_family != AF_INET) {
+        return false;
+    }
+    //The rebalance tool of a server on this host, whichever of its addresses it connected to
+    if ((ntohl(from.sin_addr.s_addr) >> 24) == IN_LOOPBACKNET
+        || (getsockname(socket, (struct sockaddr *) &local, &local_length) == 0
+            && local.sin_addr.s_addr == from.sin_addr.s_addr)) {
+        return true;
+    }
+    for (int i = 0; i < num_trusted; i++) {
+        if (trusted[i].s_addr == from.sin_addr.s_addr) {
+            return true;
+        }
+    }
+    return false;
+}
+//Stops watching the i-th idle connection.  Caller holds idle.mutex.
+static int idle_remove(int i) {
+    int fd = idle.fds[i];
+    epoll_ctl(idle.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    idle.count--;
+    idle.fds[i] = idle.fds[idle.count];
+    idle.since[i] = idle.since[idle.count];
+    return fd;
+}
+static void *idle_thread(void *arg) {
+    (void) arg;
+    struct epoll_event events[IDLE_EVENTS];
+    while (1) {
+        int n = epoll_wait(idle.epoll_fd, events, IDLE_EVENTS, CLUSTER_IDLE_MS / 4);
+        for (int i = 0; i < n; i++) {
+            int fd = -1;
+            pthread_mutex_lock(&idle.mutex);
+            for (int j = 0; j < idle.count; j++) {
+                if (idle.fds[j] == events[i].data.fd) {
+                    fd = idle_remove(j);
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&idle.mutex);
+            if (fd == -1) {
+                continue;
+            }
+            //Readable also covers the peer closing it, which shows up as EOF
+            char c;
+            if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 1) {
+                idle.ready(fd);
+            } else {
+                close(fd);
+            }
+        }
+        uint64_t now = now_ms();
+        pthread_mutex_lock(&idle.mutex);
+        for (int i = 0; i < idle.count;) {
+            if (now - idle.since[i] >= CLUSTER_IDLE_MS) {
+                close(idle_remove(i));
+            } else {
+                i++;
+            }
+        }
+        pthread_mutex_unlock(&idle.mutex);
+    }
+    return NULL;
+}
+int cluster_idle_init(void (*ready)(int socket)) {
+    pthread_t thread;
+    pthread_mutex_init(&idle.mutex, NULL);
+    idle.ready = ready;
+    idle.epoll_fd = epoll_create1(0);
+    if (idle.epoll_fd == -1 || pthread_create(&thread, NULL, idle_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+void cluster_idle_add(int socket) {
+    pthread_mutex_lock(&idle.mutex);
+    if (idle.count == idle.capacity) {
+        int capacity = idle.capacity > 0 ? idle.capacity * 2 : 64;
+        int *fds = realloc(idle.fds, capacity * sizeof(int));
+        uint64_t *since = fds != NULL ? realloc(idle.since, capacity * sizeof(uint64_t)) : NULL;
+        if (since == NULL) {
+            if (fds != NULL) {
+                idle.fds = fds;
+            }
+            pthread_mutex_unlock(&idle.mutex);
+            close(socket);
+            return;
+        }
+        idle.fds = fds;
+        idle.since = since;
+        idle.capacity = capacity;
+    }
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.fd = socket };
+    if (epoll_ctl(idle.epoll_fd, EPOLL_CTL_ADD, socket, &event) == -1) {
+        pthread_mutex_unlock(&idle.mutex);
+        close(socket);
+        return;
+    }
+    idle.fds[idle.count] = socket;
+    idle.since[idle.count] = now_ms();
+    idle.count++;
+    pthread_mutex_unlock(&idle.mutex);
+}
+static bool still_open(int fd) {
+    //A peer that timed out the connection shows up as EOF; anything else readable is unexpected
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1
+           && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+static int pool_get(Peer *peer, bool *pooled) {
+    uint64_t now = now_ms();
+    pthread_mutex_lock(&peer->mutex);
+    while (peer->num_idle > 0) {
+        peer->num_idle--;
+        int fd = peer->idle[peer->num_idle];
+        //Only reuse connections well inside the peer's idle window, so it won't close mid-request
+        if (now - peer->idle_since[peer->num_idle] < CLUSTER_IDLE_MS / 2 && still_open(fd)) {
+            pthread_mutex_unlock(&peer->mutex);
+            *pooled = true;
+            return fd;
+        }
+        close(fd);
+    }
+    pthread_mutex_unlock(&peer->mutex);
+    *pooled = false;
+    return connect_to(peer->host, peer->port);
+}
+static void pool_put(Peer *peer, int fd) {
+    pthread_mutex_lock(&peer->mutex);
+    if (peer->num_idle < CLUSTER_POOL_SIZE) {
+        peer->idle[peer->num_idle] = fd;
+        peer->idle_since[peer->num_idle] = now_ms();
+        peer->num_idle++;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&peer->mutex);
+    if (fd != -1) {
+        close(fd);
+    }
+}
+static int relay_response(int fd, int client, int *status_code) {
+    char response[2048];
+    ssize_t got = read_until(fd, response, sizeof(response) - 1, "\r\n\r\n");
+    if (got <= 0) {
+        return -1;
+    }
+    response[got] = '\0';
+    char *end = strstr(response, "\r\n\r\n");
+    if (end == NULL || sscanf(response, "HTTP/1.1 %d", status_code) != 1) {
+        return -1;
+    }
+    int content_length = 0;
+    char *cl_pointer = strstr(response, "Content-Length: ");
+    if (cl_pointer != NULL && cl_pointer < end) {
+        sscanf(cl_pointer, "Content-Length: %d", &content_length);
+    }
+    ssize_t body_read = got - (end + 4 - response);
+    ssize_t remaining = content_length - body_read;
+    if (write_n_bytes(client, response, got) != got
+        || (remaining > 0 && splice_n_bytes(fd, client, remaining) != remaining)) {
+        return 1;
+    }
+    return 0;
+}
+int cluster_forward(int peer, int client, const char *method, const char *URI,
+    const char *version, const char *request_id, size_t content_length, char *body,
+    size_t body_length, bool accept_gzip, int *status_code) {
+    char header[2048];
+    int header_length = snprintf(header, sizeof(header),
+        "%s /%s %s\r\nContent-Length: %zu\r\nRequest-Id: %s\r\n%s" CLUSTER_FORWARDED_HEADER
+        "\r\nConnection: keep-alive\r\n\r\n",
+        method, URI, version, content_length, request_id,
+        accept_gzip ? "Accept-Encoding: gzip\r\n" : "");
+    size_t remaining = content_length > body_length ? content_length - body_length : 0;
+    *status_code = 500;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool pooled;
+        int fd = pool_get(&peers[peer], &pooled);
+        if (fd == -1) {
+            return -1;
+        }
+        struct iovec iov[2] = { { header, header_length }, { body, body_length } };
+        if (writev_n_bytes(fd, iov, 2) == -1) {
+            close(fd);
+            if (pooled) {
+                continue;
+            }
+            return -1;
+        }
+        if (remaining > 0 && splice_n_bytes(client, fd, remaining) != (ssize_t) remaining) {
+            close(fd);
+            return -1;
+        }
+        int relayed = relay_response(fd, client, status_code);
+        if (relayed == 0) {
+            pool_put(&peers[peer], fd);
+            return 0;
+        }
+        close(fd);
+        if (relayed == 1) {
+            //Part of the response already reached the client; all that's left is to cut it off
+            return 0;
+        }
+        //A pooled connection the peer closed just as it was reused; the request never reached
+        //it, so it is safe to send again as long as none of the client's body has been consumed
+        *status_code = 500;
+        if (!pooled || remaining > 0) {
+            return -1;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,139 @@
+/**
+ * @File cluster.h
+ *
+ * Cluster mode.  Every server is given the same static list of peers
+ * and places them on a consistent-hash ring.  A request for a URI owned
+ * by another peer is forwarded to it over a pooled keep-alive
+ * connection, and the request and response bodies are relayed with
+ * splice.
+ *
+ * @author Brendan Lau
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+//Points each peer gets on the ring
+#define CLUSTER_VNODES 160
+//How long a server keeps a forwarded connection open waiting for the next request
+#define CLUSTER_IDLE_MS 500
+
+/** @brief Header added to forwarded requests.  A server always serves
+ *         these itself, so a request is forwarded at most once.
+ */
+#define CLUSTER_FORWARDED_HEADER "X-Cluster-Forwarded: 1"
+
+/** @brief Header added by the rebalance tool.  On a PUT, the receiving
+ *         server only stores the body if it does not already have the
+ *         URI.  A DELETE is only accepted with it, and removes the
+ *         server's own copy of a URI that has been moved.  It is ignored
+ *         unless cluster_rebalance_allowed says the sender may use it.
+ */
+#define CLUSTER_REBALANCE_HEADER "X-Cluster-Rebalance: 1"
+
+/** @brief Set by cluster_init.
+ */
+extern bool cluster_enabled;
+
+/** @brief Splits a comma-separated list of host:port pairs.
+ *
+ *  @param list The list, e.g. "localhost:8080,localhost:8081".  It is
+ *         modified in place.
+ *
+ *  @param names Set to a new array of pointers into list.
+ *
+ *  @return The number of peers, or -1 if an entry is not host:port.
+ */
+int cluster_parse_peers(char *list, char ***names);
+
+/** @brief Splits a host:port pair.
+ *
+ *  @return The port, or -1 if name is not host:port.  host gets at most
+ *          host_size - 1 characters of the host.
+ */
+int cluster_split_name(const char *name, char *host, size_t host_size);
+
+/** @brief Enables cluster mode.
+ *
+ *  @param peers The comma-separated host:port list shared by every
+ *         server in the cluster.
+ *
+ *  @param self This server's entry in peers.
+ *
+ *  @return 0, indicating success, or -1 if peers cannot be parsed or
+ *          does not contain self.
+ */
+int cluster_init(char *peers, const char *self);
+
+/** @brief Find the peer that owns a URI.
+ *
+ *  @return The peer's index, or -1 if this server owns it.
+ */
+int cluster_owner(const char *URI);
+
+/** @brief Lets rebalance requests in.  Until it is called, servers
+ *         ignore CLUSTER_REBALANCE_HEADER.  Must be called after
+ *         cluster_init, if that is called at all.
+ *
+ *  @param hosts A comma-separated list of further hosts, besides this
+ *         host and the peers, that may send rebalance requests.  It is
+ *         modified in place.
+ *
+ *  @return 0, indicating success, or -1 if a host cannot be resolved.
+ */
+int cluster_rebalance_init(char *hosts);
+
+/** @brief Whether a connection may send rebalance requests.
+ *
+ *  @return true if cluster_rebalance_init has been called and the
+ *          connection comes from loopback, an address of this host, a
+ *          peer, or one of the hosts given to cluster_rebalance_init.
+ */
+bool cluster_rebalance_allowed(int socket);
+
+/** @brief Starts the thread that watches idle forwarded connections, so
+ *         that no worker waits on one.
+ *
+ *  @param ready Called from that thread with a connection once its next
+ *         request has started to arrive.
+ *
+ *  @return 0, indicating success, or -1, indicating that it failed.
+ */
+int cluster_idle_init(void (*ready)(int socket));
+
+/** @brief Hands a forwarded connection to the idle thread after its
+ *         request has been served.  It is passed to ready when the next
+ *         request arrives, and closed if the peer closes it or sends
+ *         nothing for CLUSTER_IDLE_MS.
+ */
+void cluster_idle_add(int socket);
+
+/** @brief Forwards a request to its owner and relays the response back
+ *         to the client.  Any body bytes that were not already read
+ *         are relayed from client straight to the peer.  Blocks until
+ *         the owner's workers have served the request, so it must not
+ *         be called from a thread that serves forwarded requests.
+ *
+ *  @param peer The index returned by cluster_owner.
+ *
+ *  @param client The client socket.
+ *
+ *  @param body The body bytes already read from client.
+ *
+ *  @param body_length The number of bytes in body.
+ *
+ *  @param accept_gzip Whether the client accepts a gzip response, so
+ *         that the owner may send its compressed copy.
+ *
+ *  @param status_code Set to the status the owner responded with, or
+ *         to 500 if the owner could not be reached.
+ *
+ *  @return 0 if the owner's response was relayed (or cut short part
+ *          way through), or -1 if the owner could not be reached.  In
+ *          that case nothing has been sent to the client yet.
+ */
+int cluster_forward(int peer, int client, const char *method, const char *URI,
+    const char *version, const char *request_id, size_t content_length, char *body,
+    size_t body_length, bool accept_gzip, int *status_code);
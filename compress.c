@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "compress.h"
+#include "helper_funcs.h"
+
+#define INITIAL_BUCKETS 1024
+#define CHUNK_SIZE (64 * 1024)
+//If the first this many bytes don't compress, the rest of the object isn't read
+#define SAMPLE_SIZE (1024 * 1024)
+
+typedef enum { VARIANT_NONE, VARIANT_QUEUED, VARIANT_READY, VARIANT_SKIP } VARIANT_STATE;
+
+/*
+Every URI a gzip client has asked for has an entry.  generation counts the PUTs compress_invalidate
+has seen, so a copy that was being built from an older version is thrown away when it finishes.
+*/
+typedef struct VariantEntry {
+    char *URI;
+    uint64_t generation;
+    VARIANT_STATE state;
+    size_t length; //Of the compressed copy, once it is ready
+    struct VariantEntry *next;
+} VariantEntry;
+typedef struct CompressJob {
+    char URI[64];
+    uint64_t generation;
+    int fd; //A dup of the object's fd, so the backend may close its own
+    off_t offset;
+    size_t length;
+    struct CompressJob *next;
+} CompressJob;
+typedef struct VariantCache {
+    //Guards the table and the job list
+    pthread_mutex_t mutex;
+    pthread_cond_t job_ready;
+    VariantEntry **buckets;
+    size_t num_buckets;
+    size_t count;
+    CompressJob *head;
+    CompressJob *tail;
+    int pending;
+    size_t min_size;
+} VariantCache;
+
+bool compress_enabled = false;
+static VariantCache cache;
+//Names of formats that are already compressed
+static const char *compressed_suffixes[] = { ".gz", ".tgz", ".zip", ".bz2", ".xz", ".zst",
+    ".7z", ".png", ".jpg", ".jpeg", ".gif", ".webp", ".mp3", ".mp4", ".mkv", ".webm", ".woff2",
+    NULL };
+
+static size_t hash_uri(const char *URI) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *c = URI; *c != '\0'; c++) {
+        h ^= (unsigned char) *c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+static void cache_grow(VariantCache *c) {
+    VariantEntry **old = c->buckets;
+    size_t old_size = c->num_buckets;
+    c->num_buckets *= 2;
+    c->buckets = calloc(c->num_buckets, sizeof(VariantEntry *));
+    for (size_t i = 0; i < old_size; i++) {
+        while (old[i] != NULL) {
+            VariantEntry *e = old[i];
+            old[i] = e->next;
+            size_t bucket = hash_uri(e->URI) % c->num_buckets;
+            e->next = c->buckets[bucket];
+            c->buckets[bucket] = e;
+        }
+    }
+    free(old);
+}
+//Finds URI's entry, adding it if create is set.  Caller holds cache.mutex.
+static VariantEntry *cache_find(VariantCache *c, const char *URI, bool create) {
+    VariantEntry **e = &c->buckets[hash_uri(URI) % c->num_buckets];
+    while (*e != NULL && strcmp((*e)->URI, URI) != 0) {
+        e = &(*e)->next;
+    }
+    if (*e == NULL && create) {
+        *e = calloc(1, sizeof(VariantEntry));
+        (*e)->URI = strdup(URI);
+        (*e)->state = VARIANT_NONE;
+        c->count++;
+        VariantEntry *added = *e;
+        if (c->count > c->num_buckets) {
+            cache_grow(c);
+        }
+        return added;
+    }
+    return *e;
+}
+static void variant_path(const char *URI, const char *suffix, char *path, size_t size) {
+    snprintf(path, size, "%s/%s%s", COMPRESS_DIR, URI, suffix);
+}
+static bool compressed_type(const char *URI) {
+    size_t length = strlen(URI);
+    for (int i = 0; compressed_suffixes[i] != NULL; i++) {
+        size_t suffix_length = strlen(compressed_suffixes[i]);
+        if (length >= suffix_length
+            && strcasecmp(URI + length - suffix_length, compressed_suffixes[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+//Writes a gzip copy of length bytes of src to path.  Returns its size, or -1 on error.  Stops
+//early, returning length, once the sample shows the object won't compress enough to keep.
+static ssize_t gzip_to(int src, off_t offset, size_t length, const char *path) {
+    int dst = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dst == -1) {
+        return -1;
+    }
+    unsigned char *in = malloc(CHUNK_SIZE);
+    unsigned char *out = malloc(CHUNK_SIZE);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    //15 + 16 asks zlib for a gzip header and trailer rather than a zlib one
+    if (in == NULL || out == NULL
+        || deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)
+               != Z_OK) {
+        free(in);
+        free(out);
+        close(dst);
+        return -1;
+    }
+    size_t consumed = 0;
+    ssize_t written = 0;
+    int flush = Z_NO_FLUSH;
+    while (flush != Z_FINISH) {
+        ssize_t n = 0;
+        if (consumed < length) {
+            size_t want = length - consumed < CHUNK_SIZE ? length - consumed : CHUNK_SIZE;
+            n = pread(src, in, want, offset + consumed);
+            if (n <= 0) {
+                written = -1;
+                break;
+            }
+            consumed += n;
+        }
+        flush = consumed == length ? Z_FINISH : Z_NO_FLUSH;
+        zs.next_in = in;
+        zs.avail_in = n;
+        do {
+            zs.next_out = out;
+            zs.avail_out = CHUNK_SIZE;
+            deflate(&zs, flush);
+            ssize_t produced = CHUNK_SIZE - zs.avail_out;
+            if (write_n_bytes(dst, (char *) out, produced) != produced) {
+                written = -1;
+                break;
+            }
+            written += produced;
+        } while (zs.avail_out == 0);
+        if (written == -1) {
+            break;
+        }
+        if (consumed >= SAMPLE_SIZE && consumed < length
+            && zs.total_out > consumed * COMPRESS_MAX_RATIO) {
+            written = length;
+            break;
+        }
+    }
+    deflateEnd(&zs);
+    free(in);
+    free(out);
+    if (close(dst) == -1) {
+        written = -1;
+    }
+    return written;
+}
+static void *compress_thread(void *arg) {
+    VariantCache *c = (VariantCache *) arg;
+    char tmp_path[128];
+    char path[128];
+    while (1) {
+        pthread_mutex_lock(&c->mutex);
+        while (c->head == NULL) {
+            pthread_cond_wait(&c->job_ready, &c->mutex);
+        }
+        CompressJob *job = c->head;
+        c->head = job->next;
+        if (c->head == NULL) {
+            c->tail = NULL;
+        }
+        c->pending--;
+        pthread_mutex_unlock(&c->mutex);
+
+        variant_path(job->URI, ".tmp", tmp_path, sizeof(tmp_path));
+        variant_path(job->URI, ".gz", path, sizeof(path));
+        ssize_t compressed = gzip_to(job->fd, job->offset, job->length, tmp_path);
+        close(job->fd);
+
+        pthread_mutex_lock(&c->mutex);
+        VariantEntry *e = cache_find(c, job->URI, false);
+        if (e->generation != job->generation) {
+            unlink(tmp_path);
+        } else if (compressed == -1) {
+            unlink(tmp_path);
+            e->state = VARIANT_NONE;
+        } else if (compressed > job->length * COMPRESS_MAX_RATIO) {
+            unlink(tmp_path);
+            e->state = VARIANT_SKIP;
+        } else if (rename(tmp_path, path) == 0) {
+            e->state = VARIANT_READY;
+            e->length = compressed;
+        } else {
+            unlink(tmp_path);
+            e->state = VARIANT_NONE;
+        }
+        pthread_mutex_unlock(&c->mutex);
+        free(job);
+    }
+    return NULL;
+}
+int compress_init(size_t min_size) {
+    pthread_t thread;
+    if (mkdir(COMPRESS_DIR, 0777) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    //Copies left from a previous run may be of objects that have changed since
+    DIR *d = opendir(COMPRESS_DIR);
+    if (d == NULL) {
+        return -1;
+    }
+    struct dirent *entry;
+    char path[4096];
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", COMPRESS_DIR, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    pthread_mutex_init(&cache.mutex, NULL);
+    pthread_cond_init(&cache.job_ready, NULL);
+    cache.num_buckets = INITIAL_BUCKETS;
+    cache.buckets = calloc(cache.num_buckets, sizeof(VariantEntry *));
+    cache.min_size = min_size;
+    if (cache.buckets == NULL || pthread_create(&thread, NULL, compress_thread, &cache) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    compress_enabled = true;
+    return 0;
+}
+bool compress_accepts_gzip(const char *headers) {
+    const char *p = strstr(headers, "Accept-Encoding: ");
+    if (p == NULL) {
+        return false;
+    }
+    p += strlen("Accept-Encoding: ");
+    const char *end = strstr(p, "\r\n");
+    if (end == NULL) {
+        end = p + strlen(p);
+    }
+    //An explicit gzip entry wins over *, so "*, gzip;q=0" refuses gzip
+    double gzip_q = -1;
+    double any_q = -1;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+        const char *token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ') {
+            p++;
+        }
+        size_t token_length = p - token;
+        double q = 1;
+        const char *params = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+        const char *q_param = strstr(params, "q=");
+        if (q_param != NULL && q_param < p) {
+            q = strtod(q_param + 2, NULL);
+        }
+        if (token_length == 4 && strncasecmp(token, "gzip", 4) == 0) {
+            gzip_q = q;
+        } else if (token_length == 1 && *token == '*') {
+            any_q = q;
+        }
+    }
+    return gzip_q >= 0 ? gzip_q > 0 : any_q > 0;
+}
+int compress_open(const char *URI, StoredObject *object, StoredObject *variant) {
+    if (object->length < cache.min_size || compressed_type(URI)) {
+        return -1;
+    }
+    int result = -1;
+    pthread_mutex_lock(&cache.mutex);
+    VariantEntry *e = cache_find(&cache, URI, true);
+    if (e->state == VARIANT_READY) {
+        char path[128];
+        variant_path(URI, ".gz", path, sizeof(path));
+        variant->fd = open(path, O_RDONLY);
+        if (variant->fd != -1) {
+            variant->offset = 0;
+            variant->length = e->length;
+            variant->handle = NULL;
+            result = 0;
+        } else {
+            e->state = VARIANT_NONE;
+        }
+    }
+    if (e->state == VARIANT_NONE && cache.pending < COMPRESS_MAX_PENDING) {
+        CompressJob *job = malloc(sizeof(CompressJob));
+        int fd = dup(object->fd);
+        if (job != NULL && fd != -1) {
+            snprintf(job->URI, sizeof(job->URI), "%s", URI);
+            job->generation = e->generation;
+            job->fd = fd;
+            job->offset = object->offset;
+            job->length = object->length;
+            job->next = NULL;
+            if (cache.tail != NULL) {
+                cache.tail->next = job;
+            } else {
+                cache.head = job;
+            }
+            cache.tail = job;
+            cache.pending++;
+            e->state = VARIANT_QUEUED;
+            pthread_cond_signal(&cache.job_ready);
+        } else {
+            free(job);
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache.mutex);
+    return result;
+}
+void compress_close(StoredObject *variant) {
+    close(variant->fd);
+}
+void compress_invalidate(const char *URI) {
+    pthread_mutex_lock(&cache.mutex);
+    VariantEntry *e = cache_find(&cache, URI, false);
+    if (e != NULL) {
+        if (e->state == VARIANT_READY) {
+            char path[128];
+            variant_path(URI, ".gz", path, sizeof(path));
+            unlink(path);
+        }
+        e->generation++;
+        e->state = VARIANT_NONE;
+    }
+    pthread_mutex_unlock(&cache.mutex);
+}
@@ -0,0 +1,69 @@
+/**
+ * @File compress.h
+ *
+ * Optional gzip Content-Encoding.  The first GET for an object from a
+ * client that accepts gzip queues it for a background thread, which
+ * writes a compressed copy to COMPRESS_DIR.  Later GETs send that copy
+ * with the same zero-copy path as the object itself.  A PUT throws the
+ * copy away.  Small objects, objects whose names mark them as already
+ * compressed, and objects that do not shrink are sent as they are.
+ *
+ * @author Brendan Lau
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "storage.h"
+
+#define COMPRESS_DIR ".gzcache"
+//A compressed copy is only kept if it is at most this fraction of the original
+#define COMPRESS_MAX_RATIO 0.9
+//Objects waiting to be compressed; further requests are dropped until the queue drains
+#define COMPRESS_MAX_PENDING 256
+
+/** @brief Set by compress_init.
+ */
+extern bool compress_enabled;
+
+/** @brief Empties COMPRESS_DIR under the working directory (creating it
+ *         if needed) and starts the thread that builds compressed
+ *         copies.
+ *
+ *  @param min_size Objects smaller than this many bytes are never
+ *         compressed.
+ *
+ *  @return 0, indicating success, or -1, indicating that it failed.
+ */
+int compress_init(size_t min_size);
+
+/** @brief Checks a request's headers for an Accept-Encoding that allows
+ *         gzip.
+ *
+ *  @param headers The request's header lines, NUL terminated.
+ */
+bool compress_accepts_gzip(const char *headers);
+
+/** @brief Opens the compressed copy of an object.  If there is none and
+ *         the object is worth compressing, it is queued for the
+ *         background thread.  The caller holds the URI's reader lock.
+ *
+ *  @param object The object, as returned by the storage backend.
+ *
+ *  @param variant Set to the compressed copy.
+ *
+ *  @return 0, if variant was opened, or -1, if the object should be
+ *          sent as it is.
+ */
+int compress_open(const char *URI, StoredObject *object, StoredObject *variant);
+
+/** @brief Releases a variant returned by compress_open.
+ */
+void compress_close(StoredObject *variant);
+
+/** @brief Discards the compressed copy of URI, and any copy being
+ *         built.  Must be called after a PUT has finished writing, while
+ *         the caller still holds the URI's writer lock.
+ */
+void compress_invalidate(const char *URI);
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "helper_funcs.h"
+
+#define LISTEN_BACKLOG 128
+#define SOCKET_TIMEOUT 5
+
+static size_t pass_chunk = 64 * 1024;
+static _Thread_local char *pass_buf;
+static _Thread_local size_t pass_buf_size;
+static _Thread_local uint64_t syscalls;
+static _Thread_local int splice_pipe[2] = { -1, -1 };
+
+//Nagle is off because a kept-alive connection between servers sends the headers and the body
+//in separate writes, and holding the body back for the peer's delayed ACK stalls every request
+static int set_socket_options(int fd) {
+    struct timeval tv = { .tv_sec = SOCKET_TIMEOUT, .tv_usec = 0 };
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1
+        || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1
+        || setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+int listener_init(Listener_Socket *sock, int port) {
+    struct sockaddr_in addr;
+    int on = 1;
+    sock->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock->fd == -1) {
+        return -1;
+    }
+    setsockopt(sock->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sock->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || listen(sock->fd, LISTEN_BACKLOG) == -1) {
+        close(sock->fd);
+        sock->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+int listener_accept(Listener_Socket *sock) {
+    int fd = accept(sock->fd, NULL, NULL);
+    if (fd == -1) {
+        return -1;
+    }
+    if (set_socket_options(fd) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+int connect_to(const char *host, int port) {
+    struct addrinfo hints;
+    struct addrinfo *res;
+    char port_string[8];
+    int fd = -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_string, sizeof(port_string), "%d", port);
+    if (getaddrinfo(host, port_string, &hints, &res) != 0) {
+        return -1;
+    }
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (set_socket_options(fd) == 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+ssize_t read_until(int fd, char buf[], size_t n, char *str) {
+    size_t total = 0;
+    size_t str_len = str != NULL ? strlen(str) : 0;
+    while (total < n) {
+        //Read as much as the buffer can hold; a whole request usually arrives in one call
+        ssize_t bytes = read(fd, buf + total, n - total);
+        syscalls++;
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        //Only search the new bytes, plus enough old ones to catch a delimiter split across reads
+        size_t from = total >= str_len ? total - str_len + 1 : 0;
+        total += bytes;
+        if (str_len > 0 && total >= str_len
+            && memmem(buf + from, total - from, str, str_len) != NULL) {
+            break;
+        }
+    }
+    return total;
+}
+ssize_t read_n_bytes(int in, char buf[], size_t n) {
+    size_t total = 0;
+    while (total < n) {
+        ssize_t bytes = read(in, buf + total, n - total);
+        syscalls++;
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        total += bytes;
+    }
+    return total;
+}
+ssize_t write_n_bytes(int fd, char buf[], size_t n) {
+    size_t total = 0;
+    while (total < n) {
+        ssize_t bytes = write(fd, buf + total, n - total);
+        syscalls++;
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += bytes;
+    }
+    return total;
+}
+ssize_t writev_n_bytes(int fd, struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    while (iovcnt > 0) {
+        ssize_t bytes = writev(fd, iov, iovcnt);
+        syscalls++;
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += bytes;
+        //Drop the buffers that went out whole and advance into the one that didn't
+        while (iovcnt > 0 && (size_t) bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+    return total;
+}
+void set_pass_chunk_size(size_t size) {
+    if (size > 0) {
+        pass_chunk = size;
+    }
+}
+uint64_t io_syscall_count(void) {
+    return syscalls;
+}
+static ssize_t sendfile_n_bytes(int src, int dst, size_t n) {
+    size_t total = 0;
+    while (total < n) {
+        size_t chunk = n - total < pass_chunk ? n - total : pass_chunk;
+        ssize_t bytes = sendfile(dst, src, NULL, chunk);
+        syscalls++;
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            //Nothing sent yet, so the caller can fall back to read/write
+            return total == 0 && (errno == EINVAL || errno == ENOSYS) ? -2 : -1;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        total += bytes;
+    }
+    return total;
+}
+static char *chunk_buffer(void) {
+    if (pass_buf_size != pass_chunk) {
+        char *buf = realloc(pass_buf, pass_chunk);
+        if (buf == NULL) {
+            return NULL;
+        }
+        pass_buf = buf;
+        pass_buf_size = pass_chunk;
+    }
+    return pass_buf;
+}
+ssize_t pass_n_bytes(int src, int dst, size_t n) {
+    struct stat st;
+    if (fstat(src, &st) == 0 && S_ISREG(st.st_mode)) {
+        //Regular files can go straight to the socket without a copy through user space
+        ssize_t sent = sendfile_n_bytes(src, dst, n);
+        if (sent != -2) {
+            return sent;
+        }
+    }
+    if (chunk_buffer() == NULL) {
+        return -1;
+    }
+    size_t total = 0;
+    while (total < n) {
+        size_t chunk = n - total < pass_buf_size ? n - total : pass_buf_size;
+        ssize_t bytes = read(src, pass_buf, chunk);
+        syscalls++;
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        if (write_n_bytes(dst, pass_buf, bytes) == -1) {
+            return -1;
+        }
+        total += bytes;
+    }
+    return total;
+}
+ssize_t pass_n_bytes_at(int src, off_t offset, int dst, size_t n) {
+    size_t total = 0;
+    while (total < n) {
+        size_t chunk = n - total < pass_chunk ? n - total : pass_chunk;
+        ssize_t bytes = sendfile(dst, src, &offset, chunk);
+        syscalls++;
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes == -1 && total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break;
+        }
+        if (bytes <= 0) {
+            return bytes == 0 ? (ssize_t) total : -1;
+        }
+        total += bytes;
+    }
+    if (total == n) {
+        return total;
+    }
+    if (chunk_buffer() == NULL) {
+        return -1;
+    }
+    while (total < n) {
+        size_t chunk = n - total < pass_buf_size ? n - total : pass_buf_size;
+        ssize_t bytes = pread(src, pass_buf, chunk, offset);
+        syscalls++;
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return bytes == 0 ? (ssize_t) total : -1;
+        }
+        if (write_n_bytes(dst, pass_buf, bytes) == -1) {
+            return -1;
+        }
+        offset += bytes;
+        total += bytes;
+    }
+    return total;
+}
+ssize_t splice_n_bytes(int src, int dst, size_t n) {
+    if (splice_pipe[0] == -1 && pipe(splice_pipe) == -1) {
+        return pass_n_bytes(src, dst, n);
+    }
+    size_t total = 0;
+    while (total < n) {
+        size_t chunk = n - total < pass_chunk ? n - total : pass_chunk;
+        ssize_t in = splice(src, NULL, splice_pipe[1], NULL, chunk, SPLICE_F_MOVE);
+        syscalls++;
+        if (in == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (total == 0 && errno == EINVAL) {
+                return pass_n_bytes(src, dst, n);
+            }
+            return -1;
+        }
+        if (in == 0) {
+            break;
+        }
+        //Empty the pipe before the next read so it never holds more than one chunk
+        for (ssize_t out = 0; out < in;) {
+            ssize_t bytes = splice(splice_pipe[0], NULL, dst, NULL, in - out, SPLICE_F_MOVE);
+            syscalls++;
+            if (bytes == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                //The pipe still holds data for the old dst; start the next call with a fresh one
+                close(splice_pipe[0]);
+                close(splice_pipe[1]);
+                splice_pipe[0] = splice_pipe[1] = -1;
+                return -1;
+            }
+            out += bytes;
+        }
+        total += in;
+    }
+    return total;
+}
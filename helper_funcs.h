@@ -1,7 +1,8 @@
 /**
  * @File asgn2_helper_funcs.h
  *
- * Interfaces provided as starter code for Assignment 2.
+ * Interfaces provided as starter code for Assignment 2, implemented
+ * in-tree by helper_funcs.c.
  *
  * @author Andrew Quinn
  */
@@ -10,6 +11,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /** @struct Listener_Socket
  *  @brief This structure represents a socket listening for connections
@@ -35,6 +37,7 @@ typedef struct {
 int listener_init(Listener_Socket *sock, int port);
 
 /** @brief Accept a new connection and initialize a 5 second timeout
+ *         with Nagle's algorithm turned off
  *
  *  @param sock The Listener_Socket from which to get the new
  *              connection.
@@ -44,6 +47,18 @@ int listener_init(Listener_Socket *sock, int port);
  */
 int listener_accept(Listener_Socket *sock);
 
+/** @brief Opens a connection to host:port with the same 5 second
+ *         timeout and TCP_NODELAY as listener_accept.
+ *
+ *  @param host The host name or address to connect to.
+ *
+ *  @param port The port to connect to.
+ *
+ *  @return A socket for the new connection, or -1, if there is an
+ *          error.
+ */
+int connect_to(const char *host, int port);
+
 /** @brief Reads bytes from fd into buf until either (1) it has read
  *         n, (2) fd is out of bytes to return, (3) fd times out,
  *         (4) there is an error reading bytes, or (5) buf contains
@@ -111,3 +126,62 @@ ssize_t write_n_bytes(int fd, char buf[], size_t n);
  *          Sets errno according to any errors that occur.
  */
 ssize_t pass_n_bytes(int src, int dst, size_t n);
+
+/** @brief Writes every buffer in iov to fd, in order, using as few
+ *         writev calls as possible.
+ *
+ *  @param fd The file descriptor or socket to write to.
+ *
+ *  @param iov The buffers to write.  Entries are modified to track
+ *             partial writes.
+ *
+ *  @param iovcnt The number of entries in iov.
+ *
+ *  @return The number of bytes written, or -1, indicating an error.
+ *          Sets errno according to any errors that occur.
+ */
+ssize_t writev_n_bytes(int fd, struct iovec *iov, int iovcnt);
+
+/** @brief Like pass_n_bytes, but reads src from offset without using
+ *         or moving its file position, so threads can share src.
+ *
+ *  @param src The file descriptor from which to read.
+ *
+ *  @param offset Where in src to start reading.
+ *
+ *  @param dst The file descriptor or socket to write to.
+ *
+ *  @param n The number of bytes to read/write.
+ *
+ *  @return The number of bytes written, or -1, indicating an error.
+ *          Sets errno according to any errors that occur.
+ */
+ssize_t pass_n_bytes_at(int src, off_t offset, int dst, size_t n);
+
+/** @brief Like pass_n_bytes, but moves the bytes through a pipe with
+ *         splice so they never enter user space.  Used to relay data
+ *         between two sockets.  Falls back to pass_n_bytes if splice is
+ *         not supported for src or dst.
+ *
+ *  @param src The file descriptor or socket from which to read.
+ *
+ *  @param dst The file descriptor or socket to write to.
+ *
+ *  @param n The number of bytes to read/write.
+ *
+ *  @return The number of bytes written, or -1, indicating an error.
+ *          Sets errno according to any errors that occur.
+ */
+ssize_t splice_n_bytes(int src, int dst, size_t n);
+
+/** @brief Sets the largest number of bytes pass_n_bytes moves per
+ *         read/write or sendfile call.  Defaults to 64 KiB.
+ *
+ *  @param size The chunk size in bytes.  Must be greater than 0.
+ */
+void set_pass_chunk_size(size_t size);
+
+/** @brief Returns the number of read, write and sendfile calls the
+ *         calling thread has made through these functions.
+ */
+uint64_t io_syscall_count(void);
@@ -7,9 +7,24 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
 #include "queue.h"
 #include "rwlock.h"
 #include "helper_funcs.h"
+#include "trace.h"
+#include "cluster.h"
+#include "storage.h"
+#include "logstore.h"
+#include "capture.h"
+#include "compress.h"
+#include "shard.h"
+#include "ring.h"
+
+//GET bodies up to this size are read into memory and sent in the same writev as the header
+#define SMALL_BODY 8192
+//Client requests waiting for a forwarding thread; more than this get a 500
+#define FORWARD_QUEUE_SIZE 1024
 
 typedef struct RequestObj *Request;
 typedef struct RequestObj {
@@ -19,6 +34,43 @@ typedef struct RequestObj {
     char *content_length;
     char *request_id;
 } RequestObj;
+typedef struct Connection {
+    int socket;
+    uint64_t accept_time;
+} Connection;
+//What the worker does with a connection once a request on it has been handled
+//CONNECTION_DROP closes a kept-alive connection whose stream can't be trusted, without draining it
+typedef enum {
+    CONNECTION_CLOSE,
+    CONNECTION_DROP,
+    CONNECTION_KEEP_ALIVE,
+    CONNECTION_FORWARDED
+} CONNECTION_STATE;
+//A client request for a URI another server owns, with the body bytes read with its headers
+typedef struct ForwardJob {
+    int socket;
+    int owner;
+    uint64_t arrival;
+    Request request;
+    bool accept_gzip;
+    size_t body_length;
+    char body[2048];
+} ForwardJob;
+typedef struct ServerArgs {
+    int num_threads;
+    int port_number;
+    char *trace_path;
+    double trace_rate;
+    uint64_t trace_threshold_us;
+    size_t pass_chunk;
+    char *peers;
+    char *self;
+    size_t log_max_object;
+    char *capture_path;
+    size_t compress_min;
+    char *shard_mode;
+    char *rebalance_hosts;
+} ServerArgs;
 typedef struct FileLockStruct {
     rwlock_t *rwlock;
     char *URI;
@@ -27,7 +79,15 @@ typedef struct FileLockStruct {
 typedef struct {
     FileLockStruct *array;
     int size;
+    pthread_mutex_t mutex; //Guards the URIs and counts, not the rwlocks
 } FileLockArray;
+//Buffers for one request, allocated once per worker after it is pinned so they stay on its node
+typedef struct RequestBuffers {
+    char request[2048];
+    char header[2048];
+    char message[2048];
+    char header_copy[2048];
+} RequestBuffers;
 FileLockStruct *newLockArray(int size) {
     FileLockStruct *fl_array = calloc(size, sizeof(FileLockStruct));
     for (int i = 0; i < size; i++) {
@@ -60,7 +120,7 @@ int add_fileLock(FileLockStruct *array, char *URI, int size) {
     } else {
         pos = find_emptyPos(array, size);
         array[pos].count++;
-        array[pos].URI = calloc(strlen(URI), sizeof(char));
+        array[pos].URI = calloc(strlen(URI) + 1, sizeof(char));
         strcpy(array[pos].URI, URI);
     }
     return pos;
@@ -78,26 +138,44 @@ void remove_fileLock(FileLockStruct *array, char *URI, int size) {
         exit(1);
     }
 }
-void reader_file_lock(FileLockStruct *array, char *URI, int size) {
-    int pos = add_fileLock(array, URI, size);
-    reader_lock(array[pos].rwlock);
+//A slot's count keeps it from being reused, so the rwlock can be waited on outside the mutex
+void reader_file_lock(FileLockArray *table, char *URI) {
+    pthread_mutex_lock(&table->mutex);
+    int pos = add_fileLock(table->array, URI, table->size);
+    pthread_mutex_unlock(&table->mutex);
+    reader_lock(table->array[pos].rwlock);
 }
-void reader_file_unlock(FileLockStruct *array, char *URI, int size) {
-    int pos = find_filePos(array, URI, size);
-    reader_unlock(array[pos].rwlock);
-    remove_fileLock(array, URI, size);
+void reader_file_unlock(FileLockArray *table, char *URI) {
+    pthread_mutex_lock(&table->mutex);
+    int pos = find_filePos(table->array, URI, table->size);
+    reader_unlock(table->array[pos].rwlock);
+    remove_fileLock(table->array, URI, table->size);
+    pthread_mutex_unlock(&table->mutex);
 }
-void writer_file_lock(FileLockStruct *array, char *URI, int size) {
-    int pos = add_fileLock(array, URI, size);
-    writer_lock(array[pos].rwlock);
+void writer_file_lock(FileLockArray *table, char *URI) {
+    pthread_mutex_lock(&table->mutex);
+    int pos = add_fileLock(table->array, URI, table->size);
+    pthread_mutex_unlock(&table->mutex);
+    writer_lock(table->array[pos].rwlock);
 }
-void writer_file_unlock(FileLockStruct *array, char *URI, int size) {
-    int pos = find_filePos(array, URI, size);
-    writer_unlock(array[pos].rwlock);
-    remove_fileLock(array, URI, size);
+void writer_file_unlock(FileLockArray *table, char *URI) {
+    pthread_mutex_lock(&table->mutex);
+    int pos = find_filePos(table->array, URI, table->size);
+    writer_unlock(table->array[pos].rwlock);
+    remove_fileLock(table->array, URI, table->size);
+    pthread_mutex_unlock(&table->mutex);
 }
-//global file lock array
-FileLockArray fl_array;
+//global file lock table, striped with one stripe per shard so that workers contend on fewer
+//mutexes.  A URI always hashes to the same stripe, whichever shard serves it.
+FileLockArray *fl_tables;
+int num_fl_tables;
+FileLockArray *lock_table(char *URI) {
+    return &fl_tables[ring_hash(URI) % num_fl_tables];
+}
+//where objects are kept; the log store replaces this when enabled
+StorageBackend *storage = &file_storage;
+//client requests for other servers' URIs, served by the forwarding threads
+queue_t *forward_queue;
 
 Request newRequest() {
     Request R;
@@ -163,7 +241,7 @@ void shiftBuffer(char *buf, ssize_t max_size, ssize_t shift) {
     memset(buf, '\0', max_size);
     memcpy(buf, tempbuf, remaining_bytes);
 }
-void getContentLength(char *headerBuffer, Request request, int *status_code) {
+int getContentLength(char *headerBuffer, Request request, int *status_code) {
     char *cl_pointer = strstr(headerBuffer, "Content-Length: ");
     int content_length = 0;
     if (cl_pointer != NULL) {
@@ -176,9 +254,11 @@ void getContentLength(char *headerBuffer, Request request, int *status_code) {
     char *newline_pointer = strstr(headerBuffer, "\r\n\r\n");
     if (newline_pointer == NULL) {
         *status_code = 500;
-    } else {
-        shiftBuffer(headerBuffer, 2048, newline_pointer - headerBuffer + 4);
+        return -1;
     }
+    int header_bytes = newline_pointer - headerBuffer + 4;
+    shiftBuffer(headerBuffer, 2048, header_bytes);
+    return header_bytes;
 }
 void getRequestID(char *headerBuffer, Request request) {
     char *cl_pointer = strstr(headerBuffer, "Request-Id: ");
@@ -191,63 +271,45 @@ void getRequestID(char *headerBuffer, Request request) {
     request->request_id = calloc(10, sizeof(char));
     strcpy(request->request_id, id_string);
 }
-int getRequest(Request request, int *status_code) {
+int getRequest(Request request, StoredObject *object, int *status_code) {
     if (strcmp(request->version, "HTTP/1.1") != 0) {
         *status_code = 505;
         return -1;
     }
-    int fd = open(request->URI, O_RDONLY);
-    if (fd == -1) {
-        *status_code = 404;
+    if (storage->open(request->URI, object, status_code) == -1) {
         return -1;
     }
-    char testbuf[1];
-    int l = read_n_bytes(fd, testbuf, 1); //Try reading to see if valid file
-    if (l == -1) {
-        *status_code = 403;
-        return -1;
-    }
-    int content_length = lseek(fd, 0, SEEK_END);
-
-    close(fd);
-    *status_code = 200;
-    return (content_length);
+    return (object->length);
 }
-int putRequest(char *messageBuffer, int socket, Request request, int *status_code) {
+int putRequest(
+    char *messageBuffer, size_t body_length, int socket, Request request, int *status_code) {
     if (strcmp(request->version, "HTTP/1.1") != 0) {
         *status_code = 505;
         return -1;
     }
-    *status_code = 200;
-    int fd = open(request->URI, O_WRONLY | O_TRUNC, 0);
-    if (fd == -1) {
-        *status_code = 201;
-        fd = creat(request->URI, 0666);
-        if (fd == -1) {
-            *status_code = 500;
-            return -1;
-        }
-    }
     //Need to write remainder bytes after parsing header fields
     size_t content_length_num = atoi(request->content_length);
-    size_t bytes_written = write_n_bytes(fd, messageBuffer, strlen(messageBuffer));
-    pass_n_bytes(socket, fd, content_length_num - bytes_written);
-    close(fd);
-    return 0;
+    return storage->put(
+        request->URI, messageBuffer, body_length, socket, content_length_num, status_code);
 }
-int messagebufEmpty(char *messageBuffer) {
-    for (size_t i = 0; i < 2048; i++) {
-        if (messageBuffer[i] != 0) {
-            return 0;
-        }
-    }
-    return 1;
+void discardBody(int socket, size_t n) {
+    int fd = open("/dev/null", O_WRONLY);
+    pass_n_bytes(socket, fd, n);
+    close(fd);
 }
 void audit_log(Request request, int *status_code) {
     fprintf(
         stderr, "%s,%s,%d,%s\n", request->method, request->URI, *status_code, request->request_id);
 }
-void response(int socket, Request request, int *status_code, int content_length) {
+//Tells a client its request couldn't be forwarded.  Only the owner logs a request, so this doesn't.
+void forward_failed(int socket) {
+    char failure[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 22\r\n\r\n"
+                     "Internal Server Error\n";
+    write_n_bytes(socket, failure, sizeof(failure) - 1);
+}
+//For a small GET body, body holds it already; otherwise it is sent straight from object
+void response(int socket, Request request, int *status_code, int content_length,
+    StoredObject *object, char *body, const char *encoding) {
     char response[2048];
     if (strcmp(request->version, "HTTP/1.1") != 0) {
         *status_code = 505;
@@ -280,13 +342,24 @@ void response(int socket, Request request, int *status_code, int content_length)
     //Message Body
     int response_length;
     if (strcmp(request->method, "GET") == 0 && *status_code == 200) {
+        //Caches must not hand a gzip body to a client that didn't ask for one
+        char encoding_headers[64] = "";
+        if (encoding != NULL) {
+            snprintf(encoding_headers, sizeof(encoding_headers),
+                "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n", encoding);
+        } else if (compress_enabled) {
+            strcpy(encoding_headers, "Vary: Accept-Encoding\r\n");
+        }
         response_length
-            = snprintf(response, sizeof(response), "%s%s%s\r\nContent-Length: %d\r\n\r\n",
-                "HTTP/1.1 ", sc_string, status_phrase, content_length);
-        write_n_bytes(socket, response, response_length);
-        int fd = open(request->URI, O_RDONLY, 0);
-        pass_n_bytes(fd, socket, content_length);
-        close(fd);
+            = snprintf(response, sizeof(response), "%s%s%s\r\nContent-Length: %d\r\n%s\r\n",
+                "HTTP/1.1 ", sc_string, status_phrase, content_length, encoding_headers);
+        if (content_length <= SMALL_BODY) {
+            struct iovec iov[2] = { { response, response_length }, { body, content_length } };
+            writev_n_bytes(socket, iov, 2);
+        } else {
+            write_n_bytes(socket, response, response_length);
+            pass_n_bytes_at(object->fd, object->offset, socket, content_length);
+        }
         audit_log(request, status_code);
     } else {
         response_length
@@ -296,119 +369,418 @@ void response(int socket, Request request, int *status_code, int content_length)
         audit_log(request, status_code);
     }
 }
-void *server_thread(void *arg) {
-    queue_t *request_queue = (queue_t *) arg;
-    while (1) {
-        int *socket_pointer;
-        queue_pop(request_queue, (void **) &socket_pointer);
-        int socket = *socket_pointer;
-        int *status_code = malloc(sizeof(int));
-        char *requestBuffer = calloc(2048, sizeof(char));
-        char *headerBuffer = calloc(2048, sizeof(char));
-        char *messageBuffer = calloc(2048, sizeof(char));
-        char *headerBufferCopy = calloc(2048, sizeof(char));
-        read_until(socket, requestBuffer, 2048, "\r\n\r\n"); //read in request-line + remainder
-        Request request = newRequest();
-        int request_bytes = parseRequest(requestBuffer, request, status_code);
-        if (request_bytes == -1) { //If parsing fails, produce a response and nothing else
-            request->method = calloc(4, sizeof(char));
-            strcpy(request->method, "NONE");
-            request->version = calloc(8, sizeof(char));
-            strcpy(request->version, "HTTP/1.1");
-            response(socket, request, status_code, -1);
-        } else { //If parsing doesn't fail, continue
-            shiftBuffer(requestBuffer, 2048, request_bytes);
-            memcpy(headerBuffer, requestBuffer, 2048);
-            memcpy(headerBufferCopy, headerBuffer, 2048);
-            getContentLength(headerBuffer, request, status_code);
-            getRequestID(headerBufferCopy, request);
-            memcpy(messageBuffer, headerBuffer, 2048);
+//The arrival time of a request; only read when something records it
+uint64_t request_clock(void) {
+    return trace_enabled || capture_enabled ? trace_now() : 0;
+}
+//Hands a request to the forwarding threads, which then own it and its socket
+bool queue_forward(int socket, uint64_t arrival, int owner, Request request, char *body,
+    size_t body_length, bool accept_gzip) {
+    ForwardJob *job = malloc(sizeof(ForwardJob));
+    if (job == NULL) {
+        return false;
+    }
+    job->socket = socket;
+    job->owner = owner;
+    job->arrival = arrival;
+    job->request = request;
+    job->accept_gzip = accept_gzip;
+    job->body_length = body_length;
+    memcpy(job->body, body, body_length);
+    if (!queue_try_push(forward_queue, job)) {
+        free(job);
+        return false;
+    }
+    return true;
+}
+CONNECTION_STATE process_request(int socket, uint64_t arrival, RequestBuffers *buffers) {
+    uint64_t syscalls = io_syscall_count();
+    bool keep_alive = false;
+    bool body_read = false;
+    bool from_client = false;
+    int status = 0;
+    int *status_code = &status;
+    memset(buffers, 0, sizeof(RequestBuffers));
+    char *requestBuffer = buffers->request;
+    char *headerBuffer = buffers->header;
+    char *messageBuffer = buffers->message;
+    char *headerBufferCopy = buffers->header_copy;
+    uint64_t span_start = TRACE_NOW();
+    ssize_t received
+        = read_until(socket, requestBuffer, 2048, "\r\n\r\n"); //read in request-line + remainder
+    TRACE_SPAN(SPAN_READ, span_start);
+    span_start = TRACE_NOW();
+    Request request = newRequest();
+    int request_bytes = parseRequest(requestBuffer, request, status_code);
+    if (request_bytes == -1) { //If parsing fails, produce a response and nothing else
+        TRACE_SPAN(SPAN_PARSE, span_start);
+        request->method = calloc(5, sizeof(char));
+        strcpy(request->method, "NONE");
+        request->version = calloc(9, sizeof(char));
+        strcpy(request->version, "HTTP/1.1");
+        span_start = TRACE_NOW();
+        response(socket, request, status_code, -1, NULL, NULL, NULL);
+        TRACE_SPAN(SPAN_SEND, span_start);
+    } else { //If parsing doesn't fail, continue
+        shiftBuffer(requestBuffer, 2048, request_bytes);
+        memcpy(headerBuffer, requestBuffer, 2048);
+        memcpy(headerBufferCopy, headerBuffer, 2048);
+        int header_bytes = getContentLength(headerBuffer, request, status_code);
+        getRequestID(headerBufferCopy, request);
+        memcpy(messageBuffer, headerBuffer, 2048);
+        //Body bytes that arrived with the headers; counted rather than strlen'd so bodies may hold NULs
+        size_t body_length = 0;
+        if (header_bytes != -1 && received > request_bytes + header_bytes) {
+            body_length = received - request_bytes - header_bytes;
+        }
+        //A kept-alive connection is only reused once all of this request's body has been read,
+        //or what is left of it would be parsed as the next request
+        body_read = header_bytes != -1 && (size_t) atoi(request->content_length) == body_length;
+        //Requests from other servers in the cluster are always served here
+        bool forwarded = strstr(headerBufferCopy, CLUSTER_FORWARDED_HEADER) != NULL;
+        //Rebalance requests can delete objects, so the header only counts from trusted senders
+        bool rebalance = strstr(headerBufferCopy, CLUSTER_REBALANCE_HEADER) != NULL
+                         && cluster_rebalance_allowed(socket);
+        //Only a cluster member runs the idle thread that watches kept-alive connections
+        keep_alive = cluster_enabled && forwarded
+                     && strstr(headerBufferCopy, "Connection: keep-alive") != NULL;
+        from_client = !forwarded && !rebalance;
+        int owner = cluster_enabled && !forwarded && !rebalance ? cluster_owner(request->URI) : -1;
+        TRACE_SPAN(SPAN_PARSE, span_start);
 
-            if (strcmp(request->method, "GET") == 0) {
-                if (messagebufEmpty(messageBuffer) == 1) {
-                    reader_file_lock(fl_array.array, request->URI, fl_array.size);
-                    int file_length = getRequest(request, status_code);
-                    response(socket, request, status_code, file_length);
-                    reader_file_unlock(fl_array.array, request->URI, fl_array.size);
-                } else {
-                    *status_code = 400;
-                    response(socket, request, status_code, -1);
+        if (owner != -1
+            && (strcmp(request->method, "GET") == 0 || strcmp(request->method, "PUT") == 0)) {
+            //Never forwarded from a worker: two servers whose workers were all waiting on each
+            //other would have none left to serve the forwarded requests
+            if (queue_forward(socket, arrival, owner, request, messageBuffer, body_length,
+                    compress_accepts_gzip(headerBufferCopy))) {
+                return CONNECTION_FORWARDED;
+            }
+            *status_code = 500;
+            span_start = TRACE_NOW();
+            forward_failed(socket);
+            TRACE_SPAN(SPAN_SEND, span_start);
+        } else if (strcmp(request->method, "GET") == 0) {
+            if (body_length == 0) {
+                span_start = TRACE_NOW();
+                reader_file_lock(lock_table(request->URI), request->URI);
+                TRACE_SPAN(SPAN_LOCK_WAIT, span_start);
+                span_start = TRACE_NOW();
+                StoredObject object;
+                StoredObject variant;
+                int file_length = getRequest(request, &object, status_code);
+                bool gzipped = file_length != -1 && compress_enabled
+                               && compress_accepts_gzip(headerBufferCopy)
+                               && compress_open(request->URI, &object, &variant) == 0;
+                StoredObject *sent = gzipped ? &variant : &object;
+                int sent_length = gzipped ? (int) variant.length : file_length;
+                //Small bodies are read here so that disk_io covers the read.  Larger ones are read
+                //by sendfile as they go out, so their send span includes the disk reads.
+                char body[SMALL_BODY];
+                if (file_length != -1 && sent_length <= SMALL_BODY
+                    && pread(sent->fd, body, sent_length, sent->offset) != sent_length) {
+                    *status_code = 500;
+                    sent_length = -1;
+                }
+                TRACE_SPAN(SPAN_DISK_IO, span_start);
+                span_start = TRACE_NOW();
+                response(socket, request, status_code, sent_length, sent, body,
+                    gzipped ? "gzip" : NULL);
+                if (gzipped) {
+                    compress_close(&variant);
                 }
-            } else if (strcmp(request->method, "PUT") == 0) {
-                writer_file_lock(fl_array.array, request->URI, fl_array.size);
-                putRequest(messageBuffer, socket, request, status_code);
-                response(socket, request, status_code, -1);
-                writer_file_unlock(fl_array.array, request->URI, fl_array.size);
+                TRACE_SPAN(SPAN_SEND, span_start);
+                if (file_length != -1) {
+                    storage->close(&object);
+                }
+                reader_file_unlock(lock_table(request->URI), request->URI);
+            } else {
+                *status_code = 400;
+                span_start = TRACE_NOW();
+                response(socket, request, status_code, -1, NULL, NULL, NULL);
+                TRACE_SPAN(SPAN_SEND, span_start);
+            }
+        } else if (strcmp(request->method, "PUT") == 0) {
+            span_start = TRACE_NOW();
+            writer_file_lock(lock_table(request->URI), request->URI);
+            TRACE_SPAN(SPAN_LOCK_WAIT, span_start);
+            span_start = TRACE_NOW();
+            StoredObject existing;
+            if (rebalance && storage->open(request->URI, &existing, status_code) == 0) {
+                //Anything written here since the membership change is newer than the moved copy
+                storage->close(&existing);
+                discardBody(socket, atoi(request->content_length) - body_length);
+                *status_code = 200;
             } else {
-                *status_code = 501;
-                response(socket, request, status_code, -1);
+                body_read
+                    = putRequest(messageBuffer, body_length, socket, request, status_code) == 0;
+                if (compress_enabled) {
+                    compress_invalidate(request->URI);
+                }
+            }
+            TRACE_SPAN(SPAN_DISK_IO, span_start);
+            span_start = TRACE_NOW();
+            response(socket, request, status_code, -1, NULL, NULL, NULL);
+            TRACE_SPAN(SPAN_SEND, span_start);
+            writer_file_unlock(lock_table(request->URI), request->URI);
+        } else if (strcmp(request->method, "DELETE") == 0 && rebalance) {
+            //Only sent by the rebalance tool, for an object it has just moved to its new owner
+            span_start = TRACE_NOW();
+            writer_file_lock(lock_table(request->URI), request->URI);
+            TRACE_SPAN(SPAN_LOCK_WAIT, span_start);
+            span_start = TRACE_NOW();
+            storage->remove(request->URI, status_code);
+            if (compress_enabled) {
+                compress_invalidate(request->URI);
             }
+            TRACE_SPAN(SPAN_DISK_IO, span_start);
+            span_start = TRACE_NOW();
+            response(socket, request, status_code, -1, NULL, NULL, NULL);
+            TRACE_SPAN(SPAN_SEND, span_start);
+            writer_file_unlock(lock_table(request->URI), request->URI);
+        } else {
+            *status_code = 501;
+            span_start = TRACE_NOW();
+            response(socket, request, status_code, -1, NULL, NULL, NULL);
+            TRACE_SPAN(SPAN_SEND, span_start);
+        }
+    }
+    trace_request_end(request->method, request->URI, request->request_id, *status_code,
+        io_syscall_count() - syscalls);
+    //Only client requests are captured, so a cluster's traffic is recorded once, where it entered
+    if (capture_enabled && from_client) {
+        capture_request(arrival, request->method, request->URI, request->request_id,
+            atoi(request->content_length), *status_code);
+    }
+    freeRequest(&request);
+    if (keep_alive && !body_read) {
+        return CONNECTION_DROP;
+    }
+    return keep_alive ? CONNECTION_KEEP_ALIVE : CONNECTION_CLOSE;
+}
+//Queues a kept-alive connection again once the idle thread sees its next request
+void requeue_connection(int socket) {
+    Connection *connection = malloc(sizeof(Connection));
+    connection->socket = socket;
+    connection->accept_time = request_clock();
+    shard_push(shard_for_socket(socket), connection);
+}
+//Reads whatever the client still sends until it closes the connection or times out
+void drain(int socket) {
+    char *garbage_buf[2048];
+    int garbage_bytes = 1;
+    while (garbage_bytes > 0) {
+        garbage_bytes = read(socket, garbage_buf, 2048);
+    }
+}
+//Forwards client requests to their owners.  These threads only wait on other servers' workers,
+//which never wait on anything but this server's workers and disk, so there is no cycle.
+void *forward_thread(void *arg) {
+    (void) arg;
+    trace_thread_init();
+    while (1) {
+        ForwardJob *job = NULL;
+        queue_pop(forward_queue, (void **) &job);
+        uint64_t syscalls = io_syscall_count();
+        Request request = job->request;
+        int status_code = 500;
+        trace_request_begin(job->arrival);
+        uint64_t span_start = TRACE_NOW();
+        if (cluster_forward(job->owner, job->socket, request->method, request->URI,
+                request->version, request->request_id, atoi(request->content_length), job->body,
+                job->body_length, job->accept_gzip, &status_code)
+            == -1) {
+            forward_failed(job->socket);
         }
-        char *garbage_buf[2048];
-        int garbage_bytes = 1;
-        while (garbage_bytes != 0) {
-            garbage_bytes = read(socket, garbage_buf, 2048);
+        TRACE_SPAN(SPAN_SEND, span_start);
+        trace_request_end(request->method, request->URI, request->request_id, status_code,
+            io_syscall_count() - syscalls);
+        if (capture_enabled) {
+            capture_request(job->arrival, request->method, request->URI, request->request_id,
+                atoi(request->content_length), status_code);
         }
         freeRequest(&request);
-        free(status_code);
-        free(requestBuffer);
-        free(headerBuffer);
-        free(headerBufferCopy);
-        free(messageBuffer);
-        close(socket);
+        drain(job->socket);
+        close(job->socket);
+        free(job);
     }
 }
-void process_args(int argc, char **argv, int *num_threads, int *port_number) {
-    getopt(argc, argv, "t:");
-    if (argc == 4) {
-        if (optarg == NULL) {
-            *num_threads = 4;
-        } else {
-            *num_threads = atoi(optarg);
+void *server_thread(void *arg) {
+    int shard = shard_of_thread((int) (intptr_t) arg);
+    if (shard_pin(shard) == -1) {
+        fprintf(stderr, "Failed to pin worker to shard %d\n", shard);
+    }
+    RequestBuffers *buffers = malloc(sizeof(RequestBuffers));
+    trace_thread_init();
+    while (1) {
+        Connection *connection = shard_pop(shard);
+        int socket = connection->socket;
+        uint64_t accept_time = connection->accept_time;
+        trace_request_begin(accept_time);
+        TRACE_SPAN(SPAN_QUEUE_WAIT, accept_time);
+        free(connection);
+        CONNECTION_STATE state = process_request(socket, accept_time, buffers);
+        if (state == CONNECTION_FORWARDED) {
+            continue;
         }
-        if (argv[optind] == NULL) {
-            fprintf(stderr, "Invalid command\n");
-            exit(1);
-        } else {
-            *port_number = atoi(argv[optind]);
+        //Waiting here for the peer's next request would take this worker away from everyone else
+        if (state == CONNECTION_KEEP_ALIVE) {
+            cluster_idle_add(socket);
+            continue;
+        }
+        //A dropped connection is another server's; draining it would wait on a pooled socket
+        if (state == CONNECTION_CLOSE) {
+            drain(socket);
         }
-    } else if (argc == 2) {
-        *num_threads = 4;
-        if (optind == 1) {
-            *port_number = atoi(argv[optind]);
+        close(socket);
+    }
+}
+void process_args(int argc, char **argv, ServerArgs *args) {
+    int opt;
+    args->num_threads = 4;
+    args->trace_path = NULL;
+    args->trace_rate = 1.0;
+    args->trace_threshold_us = 0;
+    args->pass_chunk = 0;
+    args->peers = NULL;
+    args->self = NULL;
+    args->log_max_object = 0;
+    args->capture_path = NULL;
+    args->compress_min = 0;
+    args->shard_mode = NULL;
+    args->rebalance_hosts = NULL;
+    while ((opt = getopt(argc, argv, "t:T:S:L:c:P:N:s:R:z:A:B:")) != -1) {
+        if (opt == 't') {
+            args->num_threads = atoi(optarg);
+        } else if (opt == 'T') {
+            args->trace_path = optarg;
+        } else if (opt == 'S') {
+            args->trace_rate = atof(optarg);
+        } else if (opt == 'L') {
+            args->trace_threshold_us = strtoull(optarg, NULL, 10);
+        } else if (opt == 'c') {
+            args->pass_chunk = strtoull(optarg, NULL, 10);
+        } else if (opt == 'P') {
+            args->peers = optarg;
+        } else if (opt == 'N') {
+            args->self = optarg;
+        } else if (opt == 's') {
+            args->log_max_object = strtoull(optarg, NULL, 10);
+        } else if (opt == 'R') {
+            args->capture_path = optarg;
+        } else if (opt == 'z') {
+            args->compress_min = strtoull(optarg, NULL, 10);
+        } else if (opt == 'A') {
+            args->shard_mode = optarg;
+        } else if (opt == 'B') {
+            args->rebalance_hosts = optarg;
         } else {
             fprintf(stderr, "Invalid command\n");
             exit(1);
         }
-    } else {
+    }
+    if (optind != argc - 1 || args->num_threads < 1 || args->trace_rate < 0
+        || args->trace_rate > 1 || (args->peers == NULL) != (args->self == NULL)
+        || args->log_max_object > LOGSTORE_SEGMENT_SIZE / 2) {
         fprintf(stderr, "Invalid command\n");
         exit(1);
     }
+    args->port_number = atoi(argv[optind]);
 }
 int main(int argc, char **argv) {
-    int num_threads = 0;
-    int port_number = 0;
+    ServerArgs args;
 
-    process_args(argc, argv, &num_threads, &port_number);
+    process_args(argc, argv, &args);
+    int num_threads = args.num_threads;
+    int port_number = args.port_number;
 
     if (port_number < 1 || port_number > 65536) {
         fprintf(stderr, "Invalid Port\n");
         exit(1);
     }
+    //The trace and capture threads wait for these signals, so every other thread must have them
+    //blocked.  Threads inherit the mask, so it is set before any of them, helpers included, exist.
+    //Without capture, SIGINT and SIGTERM are left to kill the server as usual.
+    sigset_t waited;
+    sigemptyset(&waited);
+    if (args.trace_path != NULL) {
+        sigaddset(&waited, SIGUSR1);
+    }
+    if (args.capture_path != NULL) {
+        sigaddset(&waited, SIGINT);
+        sigaddset(&waited, SIGTERM);
+    }
+    pthread_sigmask(SIG_BLOCK, &waited, NULL);
+    //In cluster mode the forwarding threads need rings too
+    int traced_threads = args.peers != NULL ? 2 * num_threads : num_threads;
+    if (args.trace_path != NULL
+        && trace_init(args.trace_path, args.trace_rate, args.trace_threshold_us, traced_threads)
+               == -1) {
+        fprintf(stderr, "Failed to initialize tracing\n");
+        exit(1);
+    }
+    if (args.capture_path != NULL && capture_init(args.capture_path) == -1) {
+        fprintf(stderr, "Failed to open capture file %s\n", args.capture_path);
+        exit(1);
+    }
+    if (args.pass_chunk > 0) {
+        set_pass_chunk_size(args.pass_chunk);
+    }
+    if (args.peers != NULL && cluster_init(args.peers, args.self) == -1) {
+        fprintf(stderr, "Invalid peer list\n");
+        exit(1);
+    }
+    if (args.rebalance_hosts != NULL && cluster_rebalance_init(args.rebalance_hosts) == -1) {
+        fprintf(stderr, "Invalid rebalance host list\n");
+        exit(1);
+    }
+    if (cluster_enabled && cluster_idle_init(requeue_connection) == -1) {
+        fprintf(stderr, "Failed to start the idle connection thread\n");
+        exit(1);
+    }
+    if (args.log_max_object > 0 && (storage = logstore_init(args.log_max_object)) == NULL) {
+        fprintf(stderr, "Failed to open log store\n");
+        exit(1);
+    }
+    if (args.compress_min > 0 && compress_init(args.compress_min) == -1) {
+        fprintf(stderr, "Failed to open %s\n", COMPRESS_DIR);
+        exit(1);
+    }
+
+    //A client hanging up mid-response should fail the write, not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
     pthread_t threads[num_threads];
-    queue_t *request_queue = queue_new(num_threads);
-    fl_array.array = newLockArray(num_threads);
-    fl_array.size = num_threads;
+    if (shard_init(args.shard_mode, num_threads, num_threads) == -1) {
+        fprintf(stderr, "Invalid shard mode\n");
+        exit(1);
+    }
+    num_fl_tables = shard_count();
+    fl_tables = calloc(num_fl_tables, sizeof(FileLockArray));
+    for (int i = 0; i < num_fl_tables; i++) {
+        //Every worker may be using the same stripe, so each is as large as an unstriped table
+        fl_tables[i].array = newLockArray(num_threads);
+        fl_tables[i].size = num_threads;
+        pthread_mutex_init(&fl_tables[i].mutex, NULL);
+    }
 
+    if (cluster_enabled) {
+        forward_queue = queue_new(FORWARD_QUEUE_SIZE);
+        for (int i = 0; i < num_threads; i++) {
+            pthread_t forwarder;
+            pthread_create(&forwarder, NULL, forward_thread, NULL);
+            pthread_detach(forwarder);
+        }
+    }
     for (int i = 0; i < num_threads; i++) {
-        pthread_create(&threads[i], NULL, server_thread, (void *) request_queue);
+        pthread_create(&threads[i], NULL, server_thread, (void *) (intptr_t) i);
     }
     Listener_Socket sock;
     listener_init(&sock, port_number);
     while (1) {
-        int *socket_pointer = malloc(sizeof(int));
-        *socket_pointer = listener_accept(&sock);
-        queue_push(request_queue, socket_pointer);
+        Connection *connection = malloc(sizeof(Connection));
+        connection->socket = listener_accept(&sock);
+        connection->accept_time = request_clock();
+        shard_push(shard_for_socket(connection->socket), connection);
     }
 }
@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "rwlock.h"
+#include "queue.h"
+
+/*
+Microbenchmarks for rwlock_t and queue_t on their own.
+
+rwlock: every thread repeatedly takes the lock as a reader (with probability -r) or a writer, holds
+it for -c ns, releases it and waits -o ns.  Reports operations per second, reader and writer
+acquire-latency percentiles, Jain's fairness index over the threads' operation counts, writer
+starvation (the longest writer wait and the writes that waited longer than -s us) and any
+violations of mutual exclusion seen inside the critical section.
+
+queue: -P producers push timestamps, waiting -o ns between pushes, and -C consumers pop them,
+spending -c ns on each.  Reports items per second, push latency, end-to-end latency through the
+queue and the fairness of each side.
+
+Latencies are kept in log-linear histograms, so percentiles are accurate to about 6%.
+*/
+
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define HIST_SIZE (64 * SUB_BUCKETS)
+#define MAX_FIELDS 48
+
+typedef enum { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON } FORMAT;
+
+typedef struct Histogram {
+    uint64_t counts[HIST_SIZE];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+typedef struct Options {
+    PRIORITY priority;
+    uint32_t n;
+    int threads;
+    double read_ratio;
+    uint64_t inside_ns;
+    uint64_t outside_ns;
+    double seconds;
+    uint64_t starve_ns;
+    int producers;
+    int consumers;
+    int queue_size;
+    FORMAT format;
+    bool header;
+} Options;
+//One thread's results; each is allocated separately so threads don't share cache lines
+typedef struct Worker {
+    pthread_t thread;
+    int id;
+    uint32_t rand_state;
+    uint64_t ops;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t starved;
+    uint64_t violations;
+    Histogram read_wait;
+    Histogram write_wait;
+    Histogram latency; //queue: end-to-end latency, measured by consumers
+} Worker;
+//The results of a run, in the order they are printed
+typedef struct Field {
+    const char *name;
+    char value[64];
+    bool numeric;
+} Field;
+typedef struct Report {
+    Field fields[MAX_FIELDS];
+    int count;
+} Report;
+
+static Options options;
+static atomic_bool stop;
+static rwlock_t *lock;
+static queue_t *queue;
+static atomic_int readers_inside;
+static atomic_int writers_inside;
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+//Busy-waits rather than sleeping, so critical sections hold the CPU like real work would
+void spin(uint64_t ns) {
+    if (ns > 0) {
+        uint64_t end = now_ns() + ns;
+        while (now_ns() < end) {
+        }
+    }
+}
+uint32_t next_random(Worker *w) {
+    w->rand_state ^= w->rand_state << 13;
+    w->rand_state ^= w->rand_state >> 17;
+    w->rand_state ^= w->rand_state << 5;
+    return w->rand_state;
+}
+int bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+//The middle of the range of values that land in bucket
+uint64_t bucket_value(int bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t) (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+void hist_record(Histogram *h, uint64_t value) {
+    h->counts[bucket_of(value)]++;
+    h->total++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+void hist_merge(Histogram *into, Histogram *from) {
+    for (int i = 0; i < HIST_SIZE; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+uint64_t hist_percentile(Histogram *h, double p) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (p * h->total);
+    rank = rank < 1 ? 1 : rank;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_SIZE; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+//Jain's fairness index: 1 when every thread did the same amount of work, 1/n when one did it all
+double jain(Worker **workers, int first, int count) {
+    double sum = 0;
+    double sum_squares = 0;
+    for (int i = first; i < first + count; i++) {
+        sum += workers[i]->ops;
+        sum_squares += (double) workers[i]->ops * workers[i]->ops;
+    }
+    return sum_squares > 0 ? sum * sum / (count * sum_squares) : 1;
+}
+void add_field(Report *r, const char *name, bool numeric, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+void add_field(Report *r, const char *name, bool numeric, const char *format, ...) {
+    if (r->count == MAX_FIELDS) {
+        return;
+    }
+    Field *f = &r->fields[r->count++];
+    f->name = name;
+    f->numeric = numeric;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(f->value, sizeof(f->value), format, args);
+    va_end(args);
+}
+void add_latency(Report *r, Histogram *h, const char *p50, const char *p90, const char *p99,
+    const char *p999, const char *max) {
+    add_field(r, p50, true, "%lu", (unsigned long) hist_percentile(h, 0.5));
+    add_field(r, p90, true, "%lu", (unsigned long) hist_percentile(h, 0.9));
+    add_field(r, p99, true, "%lu", (unsigned long) hist_percentile(h, 0.99));
+    add_field(r, p999, true, "%lu", (unsigned long) hist_percentile(h, 0.999));
+    add_field(r, max, true, "%lu", (unsigned long) h->max);
+}
+void print_report(Report *r) {
+    if (options.format == FORMAT_TEXT) {
+        for (int i = 0; i < r->count; i++) {
+            printf("%-20s %s\n", r->fields[i].name, r->fields[i].value);
+        }
+    } else if (options.format == FORMAT_CSV) {
+        if (options.header) {
+            for (int i = 0; i < r->count; i++) {
+                printf("%s%s", i > 0 ? "," : "", r->fields[i].name);
+            }
+            printf("\n");
+        }
+        for (int i = 0; i < r->count; i++) {
+            printf("%s%s", i > 0 ? "," : "", r->fields[i].value);
+        }
+        printf("\n");
+    } else {
+        //One object per line, so runs can be appended to the same file
+        printf("{");
+        for (int i = 0; i < r->count; i++) {
+            printf("%s\"%s\":%s%s%s", i > 0 ? "," : "", r->fields[i].name,
+                r->fields[i].numeric ? "" : "\"", r->fields[i].value,
+                r->fields[i].numeric ? "" : "\"");
+        }
+        printf("}\n");
+    }
+}
+void *rwlock_thread(void *arg) {
+    Worker *w = (Worker *) arg;
+    uint32_t read_threshold = options.read_ratio * UINT32_MAX;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        bool read = options.read_ratio >= 1 || next_random(w) < read_threshold;
+        uint64_t start = now_ns();
+        if (read) {
+            reader_lock(lock);
+            uint64_t wait = now_ns() - start;
+            hist_record(&w->read_wait, wait);
+            atomic_fetch_add(&readers_inside, 1);
+            w->violations += atomic_load(&writers_inside) != 0;
+            spin(options.inside_ns);
+            atomic_fetch_sub(&readers_inside, 1);
+            reader_unlock(lock);
+            w->reads++;
+        } else {
+            writer_lock(lock);
+            uint64_t wait = now_ns() - start;
+            hist_record(&w->write_wait, wait);
+            w->starved += wait > options.starve_ns;
+            w->violations += atomic_fetch_add(&writers_inside, 1) != 0;
+            w->violations += atomic_load(&readers_inside) != 0;
+            spin(options.inside_ns);
+            atomic_fetch_sub(&writers_inside, 1);
+            writer_unlock(lock);
+            w->writes++;
+        }
+        w->ops++;
+        spin(options.outside_ns);
+    }
+    return NULL;
+}
+void *producer_thread(void *arg) {
+    Worker *w = (Worker *) arg;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        uint64_t start = now_ns();
+        //The item is its own timestamp; 0 is reserved to tell consumers to stop
+        queue_push(queue, (void *) (uintptr_t) start);
+        hist_record(&w->write_wait, now_ns() - start);
+        w->ops++;
+        spin(options.outside_ns);
+    }
+    return NULL;
+}
+void *consumer_thread(void *arg) {
+    Worker *w = (Worker *) arg;
+    while (1) {
+        void *item = NULL;
+        uint64_t start = now_ns();
+        queue_pop(queue, &item);
+        uint64_t end = now_ns();
+        if (item == NULL) {
+            return NULL;
+        }
+        hist_record(&w->read_wait, end - start);
+        hist_record(&w->latency, end - (uint64_t) (uintptr_t) item);
+        w->ops++;
+        spin(options.inside_ns);
+    }
+}
+Worker **start_workers(int count, void *(*body)(void *), int first) {
+    Worker **workers = calloc(count, sizeof(Worker *));
+    for (int i = 0; i < count; i++) {
+        workers[i] = calloc(1, sizeof(Worker));
+        workers[i]->id = first + i;
+        workers[i]->rand_state = 2463534242u + first + i;
+        pthread_create(&workers[i]->thread, NULL, body, workers[i]);
+    }
+    return workers;
+}
+void join_workers(Worker **workers, int count) {
+    for (int i = 0; i < count; i++) {
+        pthread_join(workers[i]->thread, NULL);
+    }
+}
+void run_for(double seconds) {
+    struct timespec ts = { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) };
+    while (nanosleep(&ts, &ts) != 0) {
+    }
+    atomic_store(&stop, true);
+}
+void bench_rwlock(void) {
+    const char *names[] = { "readers", "writers", "nway" };
+    lock = rwlock_new(options.priority, options.n);
+    uint64_t start = now_ns();
+    Worker **workers = start_workers(options.threads, rwlock_thread, 0);
+    run_for(options.seconds);
+    join_workers(workers, options.threads);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    Worker total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < options.threads; i++) {
+        total.ops += workers[i]->ops;
+        total.reads += workers[i]->reads;
+        total.writes += workers[i]->writes;
+        total.starved += workers[i]->starved;
+        total.violations += workers[i]->violations;
+        hist_merge(&total.read_wait, &workers[i]->read_wait);
+        hist_merge(&total.write_wait, &workers[i]->write_wait);
+    }
+    Report r;
+    r.count = 0;
+    add_field(&r, "bench", false, "rwlock");
+    add_field(&r, "priority", false, "%s", names[options.priority]);
+    add_field(&r, "n", true, "%u", options.n);
+    add_field(&r, "threads", true, "%d", options.threads);
+    add_field(&r, "read_ratio", true, "%.3f", options.read_ratio);
+    add_field(&r, "inside_ns", true, "%lu", (unsigned long) options.inside_ns);
+    add_field(&r, "outside_ns", true, "%lu", (unsigned long) options.outside_ns);
+    add_field(&r, "seconds", true, "%.3f", elapsed);
+    add_field(&r, "ops", true, "%lu", (unsigned long) total.ops);
+    add_field(&r, "ops_per_sec", true, "%.0f", total.ops / elapsed);
+    add_field(&r, "reads", true, "%lu", (unsigned long) total.reads);
+    add_field(&r, "writes", true, "%lu", (unsigned long) total.writes);
+    add_latency(&r, &total.read_wait, "read_p50_ns", "read_p90_ns", "read_p99_ns",
+        "read_p999_ns", "read_max_ns");
+    add_latency(&r, &total.write_wait, "write_p50_ns", "write_p90_ns", "write_p99_ns",
+        "write_p999_ns", "write_max_ns");
+    add_field(&r, "jain_fairness", true, "%.4f", jain(workers, 0, options.threads));
+    add_field(&r, "starved_writes", true, "%lu", (unsigned long) total.starved);
+    add_field(&r, "starved_fraction", true, "%.6f",
+        total.writes > 0 ? (double) total.starved / total.writes : 0);
+    add_field(&r, "violations", true, "%lu", (unsigned long) total.violations);
+    print_report(&r);
+    for (int i = 0; i < options.threads; i++) {
+        free(workers[i]);
+    }
+    free(workers);
+    rwlock_delete(&lock);
+}
+void bench_queue(void) {
+    queue = queue_new(options.queue_size);
+    uint64_t start = now_ns();
+    Worker **consumers = start_workers(options.consumers, consumer_thread, options.producers);
+    Worker **producers = start_workers(options.producers, producer_thread, 0);
+    run_for(options.seconds);
+    join_workers(producers, options.producers);
+    for (int i = 0; i < options.consumers; i++) {
+        queue_push(queue, NULL);
+    }
+    join_workers(consumers, options.consumers);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    Worker total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < options.producers; i++) {
+        hist_merge(&total.write_wait, &producers[i]->write_wait);
+    }
+    for (int i = 0; i < options.consumers; i++) {
+        total.ops += consumers[i]->ops;
+        hist_merge(&total.read_wait, &consumers[i]->read_wait);
+        hist_merge(&total.latency, &consumers[i]->latency);
+    }
+    Report r;
+    r.count = 0;
+    add_field(&r, "bench", false, "queue");
+    add_field(&r, "producers", true, "%d", options.producers);
+    add_field(&r, "consumers", true, "%d", options.consumers);
+    add_field(&r, "queue_size", true, "%d", options.queue_size);
+    add_field(&r, "produce_ns", true, "%lu", (unsigned long) options.outside_ns);
+    add_field(&r, "consume_ns", true, "%lu", (unsigned long) options.inside_ns);
+    add_field(&r, "seconds", true, "%.3f", elapsed);
+    add_field(&r, "ops", true, "%lu", (unsigned long) total.ops);
+    add_field(&r, "ops_per_sec", true, "%.0f", total.ops / elapsed);
+    add_latency(&r, &total.write_wait, "push_p50_ns", "push_p90_ns", "push_p99_ns",
+        "push_p999_ns", "push_max_ns");
+    add_latency(&r, &total.read_wait, "pop_p50_ns", "pop_p90_ns", "pop_p99_ns", "pop_p999_ns",
+        "pop_max_ns");
+    add_latency(&r, &total.latency, "e2e_p50_ns", "e2e_p90_ns", "e2e_p99_ns", "e2e_p999_ns",
+        "e2e_max_ns");
+    add_field(&r, "producer_fairness", true, "%.4f", jain(producers, 0, options.producers));
+    add_field(&r, "consumer_fairness", true, "%.4f", jain(consumers, 0, options.consumers));
+    print_report(&r);
+    for (int i = 0; i < options.producers; i++) {
+        free(producers[i]);
+    }
+    for (int i = 0; i < options.consumers; i++) {
+        free(consumers[i]);
+    }
+    free(producers);
+    free(consumers);
+    queue_delete(&queue);
+}
+void usage(char *name) {
+    fprintf(stderr,
+        "usage: %s rwlock [-p readers|writers|nway] [-n n] [-t threads] [-r read_ratio]\n"
+        "                 [-c inside_ns] [-o outside_ns] [-s starve_us] [-d seconds]\n"
+        "                 [-f text|csv|json] [-H]\n"
+        "       %s queue [-P producers] [-C consumers] [-q size] [-c consume_ns]\n"
+        "                [-o produce_ns] [-d seconds] [-f text|csv|json] [-H]\n",
+        name, name);
+    exit(1);
+}
+int main(int argc, char **argv) {
+    if (argc < 2 || (strcmp(argv[1], "rwlock") != 0 && strcmp(argv[1], "queue") != 0)) {
+        usage(argv[0]);
+    }
+    bool rwlock_mode = strcmp(argv[1], "rwlock") == 0;
+    options.priority = N_WAY;
+    options.n = 1;
+    options.threads = 4;
+    options.read_ratio = 0.9;
+    options.inside_ns = 100;
+    options.outside_ns = 100;
+    options.seconds = 1;
+    options.starve_ns = 10 * 1000 * 1000;
+    options.producers = 2;
+    options.consumers = 2;
+    options.queue_size = 4;
+    options.format = FORMAT_TEXT;
+    options.header = true;
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "p:n:t:r:c:o:s:d:P:C:q:f:H")) != -1) {
+        if (opt == 'p') {
+            if (strcmp(optarg, "readers") == 0) {
+                options.priority = READERS;
+            } else if (strcmp(optarg, "writers") == 0) {
+                options.priority = WRITERS;
+            } else if (strcmp(optarg, "nway") == 0) {
+                options.priority = N_WAY;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (opt == 'n') {
+            options.n = strtoul(optarg, NULL, 10);
+        } else if (opt == 't') {
+            options.threads = atoi(optarg);
+        } else if (opt == 'r') {
+            options.read_ratio = atof(optarg);
+        } else if (opt == 'c') {
+            options.inside_ns = strtoull(optarg, NULL, 10);
+        } else if (opt == 'o') {
+            options.outside_ns = strtoull(optarg, NULL, 10);
+        } else if (opt == 's') {
+            options.starve_ns = strtoull(optarg, NULL, 10) * 1000;
+        } else if (opt == 'd') {
+            options.seconds = atof(optarg);
+        } else if (opt == 'P') {
+            options.producers = atoi(optarg);
+        } else if (opt == 'C') {
+            options.consumers = atoi(optarg);
+        } else if (opt == 'q') {
+            options.queue_size = atoi(optarg);
+        } else if (opt == 'f') {
+            if (strcmp(optarg, "text") == 0) {
+                options.format = FORMAT_TEXT;
+            } else if (strcmp(optarg, "csv") == 0) {
+                options.format = FORMAT_CSV;
+            } else if (strcmp(optarg, "json") == 0) {
+                options.format = FORMAT_JSON;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (opt == 'H') {
+            options.header = false;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || options.threads < 1 || options.producers < 1 || options.consumers < 1
+        || options.queue_size < 1 || options.read_ratio < 0 || options.read_ratio > 1
+        || options.seconds <= 0) {
+        usage(argv[0]);
+    }
+    if (rwlock_mode) {
+        bench_rwlock();
+    } else {
+        bench_queue();
+    }
+    return 0;
+}
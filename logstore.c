@@ -0,0 +1,553 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "logstore.h"
+#include "helper_funcs.h"
+
+#define RECORD_MAGIC 0x4c4f4731
+#define RECORD_TOMBSTONE 1
+#define INITIAL_BUCKETS 4096
+
+/*
+A segment is a sequence of records, each a RecordHeader followed by the URI and the object.  A
+tombstone record (no object) marks a URI that was deleted from the log, either because a larger
+version of it was written to a regular file or because it was removed.  Later records win, both within a segment and across segments,
+so the index can always be rebuilt by replaying the segments in order.
+*/
+typedef struct RecordHeader {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t uri_length;
+    uint32_t checksum;
+    uint64_t length;
+} RecordHeader;
+typedef struct Segment {
+    int id;
+    int fd;
+    off_t size;
+    off_t live; //Bytes of records the index still points to, plus tombstones
+    int refs; //One for the segment table, plus one per open StoredObject
+} Segment;
+typedef struct IndexEntry {
+    char *URI;
+    Segment *segment;
+    off_t offset;
+    size_t length;
+    struct IndexEntry *next;
+} IndexEntry;
+typedef struct Store {
+    char dir[4096];
+    bool read_only;
+    size_t max_object;
+    //Guards the index, the segment table and every segment's live and refs
+    pthread_mutex_t mutex;
+    //Held across an append and the index update that goes with it, so that the order of records
+    //in the log always matches the order the index changed in
+    pthread_mutex_t append;
+    IndexEntry **buckets;
+    size_t num_buckets;
+    size_t count;
+    Segment **segments; //Sorted by id
+    int num_segments;
+    Segment *active; //Only changes under append
+    int next_id; //Only used under append
+} Store;
+
+static Store store;
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t length) {
+    const unsigned char *c = (const unsigned char *) data;
+    for (size_t i = 0; i < length; i++) {
+        h ^= c[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+static uint32_t record_checksum(RecordHeader *header, const char *URI, const char *data) {
+    uint64_t h = hash_bytes(14695981039346656037ULL, &header->flags, sizeof(header->flags));
+    h = hash_bytes(h, &header->length, sizeof(header->length));
+    h = hash_bytes(h, URI, header->uri_length);
+    h = hash_bytes(h, data, header->length);
+    return (uint32_t) (h ^ (h >> 32));
+}
+static size_t record_size(size_t uri_length, size_t length) {
+    return sizeof(RecordHeader) + uri_length + length;
+}
+static IndexEntry **index_find(Store *s, const char *URI) {
+    size_t bucket = hash_bytes(14695981039346656037ULL, URI, strlen(URI)) % s->num_buckets;
+    IndexEntry **e = &s->buckets[bucket];
+    while (*e != NULL && strcmp((*e)->URI, URI) != 0) {
+        e = &(*e)->next;
+    }
+    return e;
+}
+static void index_grow(Store *s) {
+    IndexEntry **old = s->buckets;
+    size_t old_size = s->num_buckets;
+    s->num_buckets *= 2;
+    s->buckets = calloc(s->num_buckets, sizeof(IndexEntry *));
+    for (size_t i = 0; i < old_size; i++) {
+        while (old[i] != NULL) {
+            IndexEntry *e = old[i];
+            old[i] = e->next;
+            size_t bucket
+                = hash_bytes(14695981039346656037ULL, e->URI, strlen(e->URI)) % s->num_buckets;
+            e->next = s->buckets[bucket];
+            s->buckets[bucket] = e;
+        }
+    }
+    free(old);
+}
+//Points URI at a new record, or removes it if segment is NULL.  Caller holds s->mutex.
+static void index_set(Store *s, const char *URI, Segment *segment, off_t offset, size_t length) {
+    IndexEntry **slot = index_find(s, URI);
+    IndexEntry *e = *slot;
+    if (e != NULL) {
+        e->segment->live -= record_size(strlen(URI), e->length);
+        if (segment == NULL) {
+            *slot = e->next;
+            free(e->URI);
+            free(e);
+            s->count--;
+            return;
+        }
+    } else if (segment != NULL) {
+        e = calloc(1, sizeof(IndexEntry));
+        e->URI = strdup(URI);
+        e->next = NULL;
+        *slot = e;
+        s->count++;
+    } else {
+        return;
+    }
+    e->segment = segment;
+    e->offset = offset;
+    e->length = length;
+    segment->live += record_size(strlen(URI), length);
+    if (s->count > s->num_buckets) {
+        index_grow(s);
+    }
+}
+static void segment_path(Store *s, int id, char *path, size_t size) {
+    snprintf(path, size, "%s/segment-%08d.log", s->dir, id);
+}
+static void segment_release(Segment *segment) {
+    //Caller holds store.mutex
+    segment->refs--;
+    if (segment->refs == 0) {
+        close(segment->fd);
+        free(segment);
+    }
+}
+static Segment *segment_new(Store *s) {
+    char path[4200];
+    int id = s->next_id++;
+    segment_path(s, id, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd == -1) {
+        return NULL;
+    }
+    Segment *segment = calloc(1, sizeof(Segment));
+    segment->id = id;
+    segment->fd = fd;
+    segment->refs = 1;
+    pthread_mutex_lock(&s->mutex);
+    s->segments = realloc(s->segments, (s->num_segments + 1) * sizeof(Segment *));
+    s->segments[s->num_segments++] = segment;
+    pthread_mutex_unlock(&s->mutex);
+    return segment;
+}
+//Writes one record to the active segment.  Caller holds s->append.
+static off_t append_record(Store *s, RecordHeader *header, const char *URI, const char *data) {
+    size_t size = record_size(header->uri_length, header->length);
+    if (s->active->size > 0 && s->active->size + (off_t) size > LOGSTORE_SEGMENT_SIZE) {
+        Segment *segment = segment_new(s);
+        if (segment == NULL) {
+            return -1;
+        }
+        s->active = segment;
+    }
+    struct iovec iov[3] = { { header, sizeof(RecordHeader) }, { (char *) URI, header->uri_length },
+        { (char *) data, header->length } };
+    off_t offset = s->active->size;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t bytes = pwritev(s->active->fd, iov, 3, offset + written);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            //Leave size alone so the next record overwrites whatever part of this one was written
+            return -1;
+        }
+        written += bytes;
+        for (int i = 0; i < 3; i++) {
+            size_t skip = (size_t) bytes < iov[i].iov_len ? (size_t) bytes : iov[i].iov_len;
+            iov[i].iov_base = (char *) iov[i].iov_base + skip;
+            iov[i].iov_len -= skip;
+            bytes -= skip;
+        }
+    }
+    s->active->size += size;
+    return offset;
+}
+static void fill_header(RecordHeader *header, uint32_t flags, const char *URI, const char *data,
+    size_t length) {
+    header->magic = RECORD_MAGIC;
+    header->flags = flags;
+    header->uri_length = strlen(URI);
+    header->length = length;
+    header->checksum = record_checksum(header, URI, data);
+}
+//Reads the record at offset.  Returns its size, or 0 if it is torn or not a record.
+static size_t read_record(
+    Segment *segment, off_t offset, RecordHeader *header, char **URI, char **data) {
+    if (pread(segment->fd, header, sizeof(RecordHeader), offset) != sizeof(RecordHeader)
+        || header->magic != RECORD_MAGIC || header->uri_length == 0
+        || header->uri_length > 255 || header->length > LOGSTORE_SEGMENT_SIZE) {
+        return 0;
+    }
+    size_t body = header->uri_length + header->length;
+    char *buf = malloc(body + 1);
+    if (pread(segment->fd, buf, body, offset + sizeof(RecordHeader)) != (ssize_t) body
+        || record_checksum(header, buf, buf + header->uri_length) != header->checksum) {
+        free(buf);
+        return 0;
+    }
+    //data keeps the URI in front of the object, as it is on disk
+    *URI = strndup(buf, header->uri_length);
+    *data = buf;
+    return record_size(header->uri_length, header->length);
+}
+static void replay_segment(Store *s, Segment *segment, bool last) {
+    off_t offset = 0;
+    while (offset < segment->size) {
+        RecordHeader header;
+        char *URI;
+        char *data;
+        size_t size = read_record(segment, offset, &header, &URI, &data);
+        if (size == 0) {
+            //A torn write at the tail of the newest segment is cut off; anything else is skipped
+            if (last && !s->read_only && ftruncate(segment->fd, offset) == 0) {
+                segment->size = offset;
+            }
+            fprintf(stderr, "logstore: ignoring segment %d after offset %ld\n", segment->id,
+                (long) offset);
+            return;
+        }
+        if (header.flags & RECORD_TOMBSTONE) {
+            index_set(s, URI, NULL, 0, 0);
+            segment->live += size;
+        } else {
+            index_set(s, URI, segment, offset, header.length);
+        }
+        free(URI);
+        free(data);
+        offset += size;
+    }
+}
+static int compare_ids(const void *a, const void *b) {
+    return (*(Segment *const *) a)->id - (*(Segment *const *) b)->id;
+}
+static int store_load(Store *s, const char *dir, bool read_only) {
+    memset(s, 0, sizeof(Store));
+    snprintf(s->dir, sizeof(s->dir), "%s", dir);
+    s->read_only = read_only;
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_mutex_init(&s->append, NULL);
+    s->num_buckets = INITIAL_BUCKETS;
+    s->buckets = calloc(s->num_buckets, sizeof(IndexEntry *));
+    if (!read_only && mkdir(dir, 0777) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        int id;
+        char path[4200];
+        if (sscanf(entry->d_name, "segment-%d.log", &id) != 1) {
+            continue;
+        }
+        segment_path(s, id, path, sizeof(path));
+        int fd = open(path, read_only ? O_RDONLY : O_RDWR);
+        if (fd == -1) {
+            continue;
+        }
+        Segment *segment = calloc(1, sizeof(Segment));
+        segment->id = id;
+        segment->fd = fd;
+        segment->size = lseek(fd, 0, SEEK_END);
+        segment->refs = 1;
+        s->segments = realloc(s->segments, (s->num_segments + 1) * sizeof(Segment *));
+        s->segments[s->num_segments++] = segment;
+    }
+    closedir(d);
+    qsort(s->segments, s->num_segments, sizeof(Segment *), compare_ids);
+    s->next_id = s->num_segments > 0 ? s->segments[s->num_segments - 1]->id + 1 : 0;
+    for (int i = 0; i < s->num_segments; i++) {
+        replay_segment(s, s->segments[i], i == s->num_segments - 1);
+    }
+    return 0;
+}
+static void store_free(Store *s) {
+    for (size_t i = 0; i < s->num_buckets; i++) {
+        while (s->buckets[i] != NULL) {
+            IndexEntry *e = s->buckets[i];
+            s->buckets[i] = e->next;
+            free(e->URI);
+            free(e);
+        }
+    }
+    for (int i = 0; i < s->num_segments; i++) {
+        segment_release(s->segments[i]);
+    }
+    free(s->buckets);
+    free(s->segments);
+}
+//Copies the live records of a sealed segment to the active one, then deletes it.  Returns false,
+//leaving the segment in place, if a record couldn't be copied.
+static bool compact_segment(Store *s, Segment *segment) {
+    off_t offset = 0;
+    while (offset < segment->size) {
+        RecordHeader header;
+        char *URI;
+        char *data;
+        size_t size = read_record(segment, offset, &header, &URI, &data);
+        if (size == 0) {
+            //Records past this one may still be live, so the segment has to stay
+            return false;
+        }
+        pthread_mutex_lock(&s->append);
+        pthread_mutex_lock(&s->mutex);
+        IndexEntry *e = *index_find(s, URI);
+        bool keep;
+        if (header.flags & RECORD_TOMBSTONE) {
+            //Only needed while an older segment might still hold a version it deletes
+            keep = e == NULL && s->segments[0] != segment;
+        } else {
+            keep = e != NULL && e->segment == segment && e->offset == offset;
+        }
+        pthread_mutex_unlock(&s->mutex);
+        if (keep) {
+            off_t new_offset = append_record(s, &header, URI, data + header.uri_length);
+            pthread_mutex_lock(&s->mutex);
+            if (new_offset == -1) {
+                pthread_mutex_unlock(&s->mutex);
+                pthread_mutex_unlock(&s->append);
+                free(URI);
+                free(data);
+                return false;
+            }
+            if (header.flags & RECORD_TOMBSTONE) {
+                s->active->live += size;
+            } else {
+                index_set(s, URI, s->active, new_offset, header.length);
+            }
+            pthread_mutex_unlock(&s->mutex);
+        }
+        pthread_mutex_unlock(&s->append);
+        free(URI);
+        free(data);
+        offset += size;
+    }
+    char path[4200];
+    segment_path(s, segment->id, path, sizeof(path));
+    pthread_mutex_lock(&s->mutex);
+    for (int i = 0; i < s->num_segments; i++) {
+        if (s->segments[i] == segment) {
+            memmove(&s->segments[i], &s->segments[i + 1],
+                (s->num_segments - i - 1) * sizeof(Segment *));
+            s->num_segments--;
+            break;
+        }
+    }
+    unlink(path);
+    //Readers still sending from it keep the fd (and the unlinked file) alive until they finish
+    segment_release(segment);
+    pthread_mutex_unlock(&s->mutex);
+    return true;
+}
+static void *compact_thread(void *arg) {
+    Store *s = (Store *) arg;
+    while (1) {
+        sleep(LOGSTORE_COMPACT_INTERVAL);
+        while (1) {
+            Segment *victim = NULL;
+            pthread_mutex_lock(&s->append);
+            pthread_mutex_lock(&s->mutex);
+            for (int i = 0; i < s->num_segments; i++) {
+                Segment *segment = s->segments[i];
+                if (segment != s->active && segment->live < segment->size * LOGSTORE_COMPACT_RATIO) {
+                    victim = segment;
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&s->mutex);
+            pthread_mutex_unlock(&s->append);
+            //After a failure (a full disk, say) the same victim would be picked again at once, so
+            //wait for the next pass rather than take the append lock from PUTs in a loop
+            if (victim == NULL || !compact_segment(s, victim)) {
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+static int log_open(const char *URI, StoredObject *object, int *status_code) {
+    pthread_mutex_lock(&store.mutex);
+    IndexEntry *e = *index_find(&store, URI);
+    if (e != NULL) {
+        e->segment->refs++;
+        object->fd = e->segment->fd;
+        object->offset = e->offset + sizeof(RecordHeader) + strlen(URI);
+        object->length = e->length;
+        object->handle = e->segment;
+        pthread_mutex_unlock(&store.mutex);
+        *status_code = 200;
+        return 0;
+    }
+    pthread_mutex_unlock(&store.mutex);
+    return file_storage.open(URI, object, status_code);
+}
+static void log_close(StoredObject *object) {
+    if (object->handle == NULL) {
+        file_storage.close(object);
+        return;
+    }
+    pthread_mutex_lock(&store.mutex);
+    segment_release((Segment *) object->handle);
+    pthread_mutex_unlock(&store.mutex);
+}
+//Takes URI out of the log with a tombstone.  Returns 1 if it was logged, 0 if it wasn't, or -1 if
+//the tombstone couldn't be written.  Caller holds store.append.
+static int log_drop(const char *URI) {
+    pthread_mutex_lock(&store.mutex);
+    bool logged = *index_find(&store, URI) != NULL;
+    pthread_mutex_unlock(&store.mutex);
+    if (!logged) {
+        return 0;
+    }
+    RecordHeader header;
+    fill_header(&header, RECORD_TOMBSTONE, URI, NULL, 0);
+    if (append_record(&store, &header, URI, NULL) == -1) {
+        return -1;
+    }
+    pthread_mutex_lock(&store.mutex);
+    index_set(&store, URI, NULL, 0, 0);
+    store.active->live += record_size(header.uri_length, 0);
+    pthread_mutex_unlock(&store.mutex);
+    return 1;
+}
+static int log_put(const char *URI, char *body, size_t body_length, int socket,
+    size_t content_length, int *status_code) {
+    RecordHeader header;
+    if (content_length > store.max_object) {
+        int result = file_storage.put(URI, body, body_length, socket, content_length, status_code);
+        if (result == 0) {
+            //The regular file is the newest version now, so take the old one out of the log
+            pthread_mutex_lock(&store.append);
+            if (log_drop(URI) != 0) {
+                *status_code = 200;
+            }
+            pthread_mutex_unlock(&store.append);
+        }
+        return result;
+    }
+    char *data = malloc(content_length > 0 ? content_length : 1);
+    if (body_length > content_length) {
+        body_length = content_length;
+    }
+    memcpy(data, body, body_length);
+    ssize_t rest = read_n_bytes(socket, data + body_length, content_length - body_length);
+    size_t length = body_length + (rest > 0 ? rest : 0);
+    fill_header(&header, 0, URI, data, length);
+    pthread_mutex_lock(&store.append);
+    pthread_mutex_lock(&store.mutex);
+    bool existed = *index_find(&store, URI) != NULL;
+    pthread_mutex_unlock(&store.mutex);
+    off_t offset = append_record(&store, &header, URI, data);
+    if (offset != -1) {
+        pthread_mutex_lock(&store.mutex);
+        index_set(&store, URI, store.active, offset, length);
+        pthread_mutex_unlock(&store.mutex);
+    }
+    pthread_mutex_unlock(&store.append);
+    free(data);
+    if (offset == -1) {
+        *status_code = 500;
+        return -1;
+    }
+    //A larger, older version may still be sitting in a regular file
+    if (!existed && unlink(URI) == 0) {
+        existed = true;
+    }
+    *status_code = existed ? 200 : 201;
+    return 0;
+}
+static int log_remove(const char *URI, int *status_code) {
+    pthread_mutex_lock(&store.append);
+    int dropped = log_drop(URI);
+    pthread_mutex_unlock(&store.append);
+    if (dropped == -1) {
+        *status_code = 500;
+        return -1;
+    }
+    //An older, larger version may also be in a regular file
+    if (file_storage.remove(URI, status_code) == -1 && dropped == 1 && *status_code == 404) {
+        *status_code = 200;
+        return 0;
+    }
+    return *status_code == 200 ? 0 : -1;
+}
+
+static StorageBackend log_storage = { log_open, log_close, log_put, log_remove };
+
+StorageBackend *logstore_init(size_t max_object) {
+    pthread_t thread;
+    if (store_load(&store, LOGSTORE_DIR, false) == -1) {
+        return NULL;
+    }
+    store.max_object = max_object;
+    if (store.num_segments > 0
+        && store.segments[store.num_segments - 1]->size < LOGSTORE_SEGMENT_SIZE) {
+        store.active = store.segments[store.num_segments - 1];
+    } else if ((store.active = segment_new(&store)) == NULL) {
+        return NULL;
+    }
+    if (pthread_create(&thread, NULL, compact_thread, &store) != 0) {
+        return NULL;
+    }
+    pthread_detach(thread);
+    return &log_storage;
+}
+int logstore_scan(const char *dir, logstore_visit visit, void *arg) {
+    Store s;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, LOGSTORE_DIR);
+    if (store_load(&s, path, true) == -1) {
+        store_free(&s);
+        return -1;
+    }
+    int visited = 0;
+    for (size_t i = 0; i < s.num_buckets; i++) {
+        for (IndexEntry *e = s.buckets[i]; e != NULL; e = e->next) {
+            visit(e->URI, e->segment->fd, e->offset + sizeof(RecordHeader) + strlen(e->URI),
+                e->length, arg);
+            visited++;
+        }
+    }
+    store_free(&s);
+    return visited;
+}
@@ -0,0 +1,53 @@
+/**
+ * @File logstore.h
+ *
+ * A storage backend for small objects.  Instead of one file per URI,
+ * small objects are appended to large segment files in LOGSTORE_DIR and
+ * found through an in-memory hash index of URI -> (segment, offset,
+ * length).  The index is rebuilt by scanning the segments at startup,
+ * and a background thread compacts segments that are mostly garbage.
+ * Objects larger than the limit still go to regular files.
+ *
+ * @author Brendan Lau
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "storage.h"
+
+#define LOGSTORE_DIR ".logstore"
+//A segment is sealed once it reaches this size
+#ifndef LOGSTORE_SEGMENT_SIZE
+#define LOGSTORE_SEGMENT_SIZE (64 * 1024 * 1024)
+#endif
+//Seconds between compaction passes
+#ifndef LOGSTORE_COMPACT_INTERVAL
+#define LOGSTORE_COMPACT_INTERVAL 10
+#endif
+//Sealed segments with less than this fraction of live bytes are compacted
+#define LOGSTORE_COMPACT_RATIO 0.5
+
+/** @brief Opens (or creates) the log store in LOGSTORE_DIR under the
+ *         working directory, rebuilds its index and starts compaction.
+ *
+ *  @param max_object Objects up to this many bytes are kept in the log;
+ *         larger ones are passed to file_storage.
+ *
+ *  @return The backend, or NULL if the store could not be opened.
+ */
+StorageBackend *logstore_init(size_t max_object);
+
+/** @brief Called by logstore_scan for every live object.
+ */
+typedef void (*logstore_visit)(
+    const char *URI, int fd, off_t offset, size_t length, void *arg);
+
+/** @brief Reads the log store under dir without modifying it and calls
+ *         visit for the newest version of every object.
+ *
+ *  @return The number of objects visited, or -1 if dir has no log
+ *          store.
+ */
+int logstore_scan(const char *dir, logstore_visit visit, void *arg);
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
 #include "queue.h"
 
 typedef struct queue {
@@ -69,3 +70,51 @@ bool queue_pop(queue_t *q, void **elem) {
         return false;
     }
 }
+bool queue_try_push(queue_t *q, void *elem) {
+    if (q != NULL) {
+        pthread_mutex_lock(&q->mutex);
+        if (q->num_elem == q->size) {
+            pthread_mutex_unlock(&q->mutex);
+            return false;
+        }
+        q->arr[q->in] = elem;
+        q->in = (q->in + 1) % q->size;
+        q->num_elem++;
+        pthread_cond_signal(&q->not_empty);
+        pthread_mutex_unlock(&q->mutex);
+        return true;
+    } else {
+        return false;
+    }
+}
+bool queue_pop_timeout(queue_t *q, void **elem, int timeout_ms) {
+    if (q != NULL) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&q->mutex);
+        while (q->num_elem == 0) {
+            if (timeout_ms == 0
+                || pthread_cond_timedwait(&q->not_empty, &q->mutex, &deadline) != 0) {
+                if (q->num_elem > 0) {
+                    break;
+                }
+                pthread_mutex_unlock(&q->mutex);
+                return false;
+            }
+        }
+        *elem = q->arr[q->out];
+        q->out = (q->out + 1) % q->size;
+        q->num_elem--;
+        pthread_cond_signal(&q->not_full);
+        pthread_mutex_unlock(&q->mutex);
+        return true;
+    } else {
+        return false;
+    }
+}
@@ -53,3 +53,28 @@ bool queue_push(queue_t *q, void *elem);
  *          should succeed unless the q parameter is NULL.
  */
 bool queue_pop(queue_t *q, void **elem);
+
+/** @brief push an element onto a queue without waiting.
+ *
+ *  @param q the queue to push an element into.
+ *
+ *  @param elem the element to add to the queue
+ *
+ *  @return true if elem was added, or false if the queue is full or q
+ *          is NULL.
+ */
+bool queue_try_push(queue_t *q, void *elem);
+
+/** @brief pop an element from a queue, waiting at most timeout_ms
+ *         milliseconds for one to arrive.
+ *
+ *  @param q the queue to pop an element from.
+ *
+ *  @param elem a place to assign the poped element.
+ *
+ *  @param timeout_ms how long to wait; 0 returns at once.
+ *
+ *  @return true if an element was popped, or false if the queue stayed
+ *          empty or q is NULL.
+ */
+bool queue_pop_timeout(queue_t *q, void **elem, int timeout_ms);
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <regex.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "cluster.h"
+#include "ring.h"
+#include "logstore.h"
+#include "helper_funcs.h"
+
+/*
+Moves the files in one server's directory to their owners after the cluster membership changes.
+Run it on every server once they have been restarted with the new peer list.  Each file that the
+new ring assigns to another peer is PUT there with CLUSTER_REBALANCE_HEADER, which never overwrites
+a copy the owner already has, and is then removed locally.  Objects in the log store are copied the
+same way.  Only the running server may append to its log, so the tool then sends it a DELETE with
+CLUSTER_REBALANCE_HEADER, which writes a tombstone.  A stale copy left in the log would be served
+again if the URI ever mapped back to this server, and would win over the current version when that
+was rebalanced back here.  Servers only honour CLUSTER_REBALANCE_HEADER when started with -B.
+*/
+
+typedef struct Rebalance {
+    ring_t *ring;
+    char **names;
+    char *self;
+    char self_host[256];
+    int self_port;
+    bool dry_run;
+    int moved;
+    int failed;
+} Rebalance;
+
+void usage(char *name) {
+    fprintf(stderr, "usage: %s -P peers -N self [-d dir] [-n]\n", name);
+    exit(1);
+}
+//Sends a request with size bytes of fd as its body, and returns the status of the response
+int send_request(const char *host, int port, const char *method, const char *URI, int fd,
+    off_t offset, off_t size) {
+    char buf[2048];
+    int socket = connect_to(host, port);
+    if (socket == -1) {
+        return -1;
+    }
+    int length = snprintf(buf, sizeof(buf),
+        "%s /%s HTTP/1.1\r\nContent-Length: %ld\r\nRequest-Id: 0\r\n" CLUSTER_REBALANCE_HEADER
+        "\r\n\r\n",
+        method, URI, (long) size);
+    int status_code = -1;
+    if (write_n_bytes(socket, buf, length) == length
+        && (size == 0 || pass_n_bytes_at(fd, offset, socket, size) == size)) {
+        ssize_t got = read_until(socket, buf, sizeof(buf) - 1, "\r\n\r\n");
+        if (got > 0) {
+            buf[got] = '\0';
+            sscanf(buf, "HTTP/1.1 %d", &status_code);
+        }
+    }
+    close(socket);
+    return status_code;
+}
+//Sends one object to its owner if that is not this server.  Returns true if it was sent.
+bool move_object(Rebalance *r, const char *URI, int fd, off_t offset, off_t size) {
+    char *owner = r->names[ring_lookup(r->ring, URI)];
+    if (strcmp(owner, r->self) == 0) {
+        return false;
+    }
+    printf("%s -> %s\n", URI, owner);
+    if (r->dry_run) {
+        r->moved++;
+        return false;
+    }
+    char host[256];
+    int port = cluster_split_name(owner, host, sizeof(host));
+    int status_code = send_request(host, port, "PUT", URI, fd, offset, size);
+    if (status_code == 200 || status_code == 201) {
+        r->moved++;
+        return true;
+    }
+    fprintf(stderr, "Failed to move %s to %s\n", URI, owner);
+    r->failed++;
+    return false;
+}
+void move_logged(const char *URI, int fd, off_t offset, size_t length, void *arg) {
+    Rebalance *r = (Rebalance *) arg;
+    if (move_object(r, URI, fd, offset, length)
+        && send_request(r->self_host, r->self_port, "DELETE", URI, -1, 0, 0) != 200) {
+        fprintf(stderr, "Failed to remove %s from the log store\n", URI);
+        r->failed++;
+    }
+}
+int main(int argc, char **argv) {
+    char *peer_list = NULL;
+    char *self = NULL;
+    char *dir = ".";
+    bool dry_run = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "P:N:d:n")) != -1) {
+        if (opt == 'P') {
+            peer_list = optarg;
+        } else if (opt == 'N') {
+            self = optarg;
+        } else if (opt == 'd') {
+            dir = optarg;
+        } else if (opt == 'n') {
+            dry_run = true;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (peer_list == NULL || self == NULL || optind != argc) {
+        usage(argv[0]);
+    }
+    char **names;
+    int num_peers = cluster_parse_peers(peer_list, &names);
+    if (num_peers < 1) {
+        fprintf(stderr, "Invalid peer list\n");
+        exit(1);
+    }
+    ring_t *ring = ring_new(names, num_peers, CLUSTER_VNODES);
+    if (chdir(dir) == -1) {
+        fprintf(stderr, "Can't open %s\n", dir);
+        exit(1);
+    }
+    //Same names the server accepts as URIs; anything else was not stored through the server
+    regex_t regex;
+    regcomp(&regex, "^[a-zA-Z0-9.-]{1,63}$", REG_EXTENDED | REG_NOSUB);
+    DIR *d = opendir(".");
+    if (d == NULL) {
+        fprintf(stderr, "Can't open %s\n", dir);
+        exit(1);
+    }
+    Rebalance r = { .ring = ring, .names = names, .self = self, .dry_run = dry_run };
+    r.self_port = cluster_split_name(self, r.self_host, sizeof(r.self_host));
+    if (r.self_port == -1) {
+        fprintf(stderr, "Invalid server name %s\n", self);
+        exit(1);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        struct stat st;
+        if (regexec(&regex, entry->d_name, 0, NULL, 0) != 0 || stat(entry->d_name, &st) == -1
+            || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        int fd = open(entry->d_name, O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        if (move_object(&r, entry->d_name, fd, 0, st.st_size) && unlink(entry->d_name) == -1) {
+            fprintf(stderr, "Failed to remove %s\n", entry->d_name);
+        }
+        close(fd);
+    }
+    closedir(d);
+    logstore_scan(".", move_logged, &r);
+    regfree(&regex);
+    ring_delete(&ring);
+    free(names);
+    printf("%d moved, %d failed\n", r.moved, r.failed);
+    return r.failed > 0 ? 1 : 0;
+}
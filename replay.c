@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include "capture.h"
+#include "cluster.h"
+#include "queue.h"
+#include "trace.h"
+#include "helper_funcs.h"
+
+/*
+Re-drives a capture file (httpserver -R) against a server.  Each request is sent at its captured
+arrival time, divided by the speed-up, by a pool of clients as large as the most requests the
+captured server had in flight at once, so bursts keep their shape.  PUT bodies are generated, since
+only their length is captured.  Reports latency percentiles per method next to the captured ones.
+Given the replaying server's audit log, it also reports every URI whose requests were logged in a
+different order than they were captured in.
+*/
+
+//A request that starts more than this long after its scheduled time is counted as late
+#define LATE_US 1000
+//URIs with ordering differences that are printed individually
+#define MAX_REPORTED 10
+//How long to wait for the audit log to reach as many lines as requests were replayed
+#define AUDIT_WAIT_MS 1000
+
+typedef struct Result {
+    uint64_t latency_us;
+    int status_code; //-1 if the request failed
+    bool late;
+} Result;
+typedef struct Replay {
+    char host[256];
+    int port;
+    double speed;
+    uint64_t start;
+    CaptureEntry *entries;
+    Result *results;
+    queue_t *queue;
+} Replay;
+//One line of an audit log, or a captured request in completion order
+typedef struct AuditItem {
+    char method[9];
+    char URI[64];
+    int request_id;
+    size_t pos;
+} AuditItem;
+
+static char body_pattern[64 * 1024];
+static int dev_null;
+
+void usage(char *name) {
+    fprintf(stderr, "usage: %s [-x speed] [-c clients] [-a audit_log] host:port capture_file\n",
+        name);
+    exit(1);
+}
+int compare_arrival(const void *a, const void *b) {
+    const CaptureEntry *x = *(CaptureEntry *const *) a;
+    const CaptureEntry *y = *(CaptureEntry *const *) b;
+    return (x->record.arrival_us > y->record.arrival_us)
+           - (x->record.arrival_us < y->record.arrival_us);
+}
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+//Sorts by URI and keeps each URI's items in their original order
+int compare_audit(const void *a, const void *b) {
+    const AuditItem *x = (const AuditItem *) a;
+    const AuditItem *y = (const AuditItem *) b;
+    int c = strcmp(x->URI, y->URI);
+    return c != 0 ? c : (x->pos > y->pos) - (x->pos < y->pos);
+}
+//The most requests that were in flight at once while the capture was taken
+int peak_concurrency(CaptureEntry *entries, size_t n) {
+    uint64_t *starts = malloc(n * sizeof(uint64_t));
+    uint64_t *ends = malloc(n * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++) {
+        starts[i] = entries[i].record.arrival_us;
+        ends[i] = entries[i].record.arrival_us + entries[i].record.duration_us;
+    }
+    qsort(starts, n, sizeof(uint64_t), compare_u64);
+    qsort(ends, n, sizeof(uint64_t), compare_u64);
+    int in_flight = 0;
+    int peak = 1;
+    size_t j = 0;
+    for (size_t i = 0; i < n; i++) {
+        while (j < n && ends[j] <= starts[i]) {
+            in_flight--;
+            j++;
+        }
+        in_flight++;
+        peak = in_flight > peak ? in_flight : peak;
+    }
+    free(starts);
+    free(ends);
+    return peak;
+}
+void sleep_until(uint64_t when) {
+    struct timespec ts = { when / 1000000000, when % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+    }
+}
+//Sends one request and reads the whole response.  Returns the status code, or -1.
+int send_request(Replay *r, CaptureEntry *entry) {
+    char buf[2048];
+    int socket = connect_to(r->host, r->port);
+    if (socket == -1) {
+        return -1;
+    }
+    size_t body_length = entry->record.body_length;
+    int length = snprintf(buf, sizeof(buf), "%s /%s HTTP/1.1\r\nRequest-Id: %d\r\n",
+        entry->method, entry->URI, entry->record.request_id);
+    if (body_length > 0 || strcmp(entry->method, "PUT") == 0) {
+        length += snprintf(
+            buf + length, sizeof(buf) - length, "Content-Length: %zu\r\n", body_length);
+    }
+    length += snprintf(buf + length, sizeof(buf) - length, "\r\n");
+    int status_code = -1;
+    if (write_n_bytes(socket, buf, length) != length) {
+        close(socket);
+        return -1;
+    }
+    while (body_length > 0) {
+        size_t n = body_length < sizeof(body_pattern) ? body_length : sizeof(body_pattern);
+        if (write_n_bytes(socket, body_pattern, n) != (ssize_t) n) {
+            close(socket);
+            return -1;
+        }
+        body_length -= n;
+    }
+    ssize_t got = read_until(socket, buf, sizeof(buf) - 1, "\r\n\r\n");
+    if (got > 0) {
+        buf[got] = '\0';
+        char *end = strstr(buf, "\r\n\r\n");
+        char *cl = strstr(buf, "Content-Length: ");
+        long content_length = 0;
+        if (end != NULL && sscanf(buf, "HTTP/1.1 %d", &status_code) == 1 && cl != NULL) {
+            sscanf(cl, "Content-Length: %ld", &content_length);
+            long extra = got - (end + 4 - buf);
+            if (content_length > extra) {
+                pass_n_bytes(socket, dev_null, content_length - extra);
+            }
+        }
+    }
+    close(socket);
+    return status_code;
+}
+void *client_thread(void *arg) {
+    Replay *r = (Replay *) arg;
+    while (1) {
+        CaptureEntry *entry = NULL;
+        queue_pop(r->queue, (void **) &entry);
+        if (entry == NULL) {
+            return NULL;
+        }
+        Result *result = &r->results[entry - r->entries];
+        if (r->speed > 0) {
+            uint64_t when = r->start + entry->record.arrival_us * 1000 / r->speed;
+            sleep_until(when);
+            result->late = trace_now() > when + LATE_US * 1000;
+        }
+        uint64_t start = trace_now();
+        result->status_code = send_request(r, entry);
+        result->latency_us = (trace_now() - start) / 1000;
+    }
+}
+uint64_t percentile(uint64_t *sorted, size_t n, double p) {
+    return n == 0 ? 0 : sorted[(size_t) (p * (n - 1) + 0.5)];
+}
+void report_latency(Replay *r, size_t n) {
+    const char *methods[] = { "GET", "PUT", NULL };
+    uint64_t *replayed = malloc(n * sizeof(uint64_t));
+    uint64_t *captured = malloc(n * sizeof(uint64_t));
+    printf("%-6s %7s %6s %9s %9s %9s %9s   %9s %9s\n", "method", "count", "errors", "p50_us",
+        "p90_us", "p99_us", "max_us", "cap_p50", "cap_p99");
+    for (int m = 0; m < 3; m++) {
+        size_t count = 0;
+        size_t errors = 0;
+        for (size_t i = 0; i < n; i++) {
+            bool other = strcmp(r->entries[i].method, "GET") != 0
+                         && strcmp(r->entries[i].method, "PUT") != 0;
+            if (methods[m] != NULL ? strcmp(r->entries[i].method, methods[m]) != 0 : !other) {
+                continue;
+            }
+            errors += r->results[i].status_code == -1;
+            replayed[count] = r->results[i].latency_us;
+            captured[count] = r->entries[i].record.duration_us;
+            count++;
+        }
+        if (count == 0) {
+            continue;
+        }
+        qsort(replayed, count, sizeof(uint64_t), compare_u64);
+        qsort(captured, count, sizeof(uint64_t), compare_u64);
+        printf("%-6s %7zu %6zu %9lu %9lu %9lu %9lu   %9lu %9lu\n",
+            methods[m] != NULL ? methods[m] : "other", count, errors,
+            (unsigned long) percentile(replayed, count, 0.5),
+            (unsigned long) percentile(replayed, count, 0.9),
+            (unsigned long) percentile(replayed, count, 0.99),
+            (unsigned long) replayed[count - 1], (unsigned long) percentile(captured, count, 0.5),
+            (unsigned long) percentile(captured, count, 0.99));
+    }
+    free(replayed);
+    free(captured);
+}
+AuditItem *read_audit_log(const char *path, size_t *count) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    size_t capacity = 1024;
+    size_t n = 0;
+    AuditItem *items = malloc(capacity * sizeof(AuditItem));
+    char line[256];
+    while (items != NULL && fgets(line, sizeof(line), file) != NULL) {
+        AuditItem item;
+        int status_code;
+        if (sscanf(line, "%8[^,],%63[^,],%d,%d", item.method, item.URI, &status_code,
+                &item.request_id)
+            != 4) {
+            continue;
+        }
+        item.pos = n;
+        if (n == capacity) {
+            capacity *= 2;
+            AuditItem *grown = realloc(items, capacity * sizeof(AuditItem));
+            if (grown == NULL) {
+                break;
+            }
+            items = grown;
+        }
+        items[n++] = item;
+    }
+    fclose(file);
+    *count = n;
+    return items;
+}
+bool same_request(AuditItem *a, AuditItem *b) {
+    return strcmp(a->method, b->method) == 0 && a->request_id == b->request_id;
+}
+//Compares each URI's sequence of requests in the capture with the one in the audit log
+void report_ordering(CaptureEntry *entries, size_t n, AuditItem *logged, size_t n_logged) {
+    AuditItem *captured = malloc(n * sizeof(AuditItem));
+    for (size_t i = 0; i < n; i++) {
+        strcpy(captured[i].method, entries[i].method);
+        strcpy(captured[i].URI, entries[i].URI);
+        captured[i].request_id = entries[i].record.request_id;
+        captured[i].pos = i;
+    }
+    qsort(captured, n, sizeof(AuditItem), compare_audit);
+    qsort(logged, n_logged, sizeof(AuditItem), compare_audit);
+    size_t i = 0;
+    size_t j = 0;
+    int uris = 0;
+    int differ = 0;
+    while (i < n || j < n_logged) {
+        //The next URI in either list, and the extent of its run in each
+        const char *URI = j == n_logged || (i < n && strcmp(captured[i].URI, logged[j].URI) <= 0)
+                              ? captured[i].URI
+                              : logged[j].URI;
+        size_t i_end = i;
+        size_t j_end = j;
+        while (i_end < n && strcmp(captured[i_end].URI, URI) == 0) {
+            i_end++;
+        }
+        while (j_end < n_logged && strcmp(logged[j_end].URI, URI) == 0) {
+            j_end++;
+        }
+        size_t k = 0;
+        while (i + k < i_end && j + k < j_end && same_request(&captured[i + k], &logged[j + k])) {
+            k++;
+        }
+        uris++;
+        if (i + k < i_end || j + k < j_end) {
+            if (differ < MAX_REPORTED) {
+                printf("  %s: request %zu: captured ", URI, k + 1);
+                if (i + k < i_end) {
+                    printf("%s %d", captured[i + k].method, captured[i + k].request_id);
+                } else {
+                    printf("nothing");
+                }
+                printf(", logged ");
+                if (j + k < j_end) {
+                    printf("%s %d\n", logged[j + k].method, logged[j + k].request_id);
+                } else {
+                    printf("nothing\n");
+                }
+            }
+            differ++;
+        }
+        i = i_end;
+        j = j_end;
+    }
+    printf("ordering: %d of %d URIs differ\n", differ, uris);
+    free(captured);
+}
+int main(int argc, char **argv) {
+    double speed = 1.0;
+    int clients = 0;
+    char *audit_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "x:c:a:")) != -1) {
+        if (opt == 'x') {
+            speed = atof(optarg);
+        } else if (opt == 'c') {
+            clients = atoi(optarg);
+        } else if (opt == 'a') {
+            audit_path = optarg;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2 || speed < 0 || clients < 0) {
+        usage(argv[0]);
+    }
+    Replay r;
+    r.port = cluster_split_name(argv[optind], r.host, sizeof(r.host));
+    if (r.port == -1) {
+        fprintf(stderr, "Invalid server %s\n", argv[optind]);
+        exit(1);
+    }
+    size_t n;
+    r.entries = capture_load(argv[optind + 1], &n, NULL);
+    if (r.entries == NULL) {
+        fprintf(stderr, "Can't read capture %s\n", argv[optind + 1]);
+        exit(1);
+    }
+    if (clients == 0) {
+        clients = peak_concurrency(r.entries, n);
+    }
+    r.speed = speed;
+    r.results = calloc(n, sizeof(Result));
+    r.queue = queue_new(clients);
+    for (size_t i = 0; i < sizeof(body_pattern); i++) {
+        body_pattern[i] = 'a' + i % 26;
+    }
+    dev_null = open("/dev/null", O_WRONLY);
+    signal(SIGPIPE, SIG_IGN);
+
+    //Entries stay in completion order for the ordering report; requests are issued by arrival
+    CaptureEntry **schedule = malloc(n * sizeof(CaptureEntry *));
+    for (size_t i = 0; i < n; i++) {
+        schedule[i] = &r.entries[i];
+    }
+    qsort(schedule, n, sizeof(CaptureEntry *), compare_arrival);
+    uint64_t first = n > 0 ? schedule[0]->record.arrival_us : 0;
+    for (size_t i = 0; i < n; i++) {
+        schedule[i]->record.arrival_us -= first;
+    }
+    pthread_t threads[clients];
+    r.start = trace_now();
+    for (int i = 0; i < clients; i++) {
+        pthread_create(&threads[i], NULL, client_thread, &r);
+    }
+    for (size_t i = 0; i < n; i++) {
+        queue_push(r.queue, schedule[i]);
+    }
+    for (int i = 0; i < clients; i++) {
+        queue_push(r.queue, NULL);
+    }
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (trace_now() - r.start) / 1e9;
+
+    size_t late = 0;
+    size_t mismatched = 0;
+    for (size_t i = 0; i < n; i++) {
+        late += r.results[i].late;
+        mismatched += r.results[i].status_code != r.entries[i].record.status_code;
+    }
+    printf("replayed %zu requests with %d clients in %.3f s (%zu late, %zu status changes)\n",
+        n, clients, elapsed, late, mismatched);
+    report_latency(&r, n);
+    if (audit_path != NULL) {
+        size_t n_logged;
+        AuditItem *logged = read_audit_log(audit_path, &n_logged);
+        //The server logs a GET after sending its body, so the last lines may still be on their way
+        for (int i = 0; i < AUDIT_WAIT_MS / 100 && logged != NULL && n_logged < n; i++) {
+            free(logged);
+            usleep(100 * 1000);
+            logged = read_audit_log(audit_path, &n_logged);
+        }
+        if (logged == NULL) {
+            fprintf(stderr, "Can't read audit log %s\n", audit_path);
+            exit(1);
+        }
+        report_ordering(r.entries, n, logged, n_logged);
+        free(logged);
+    }
+    queue_delete(&r.queue);
+    free(schedule);
+    free(r.results);
+    free(r.entries);
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "ring.h"
+
+typedef struct RingPoint {
+    uint64_t hash;
+    int node;
+} RingPoint;
+typedef struct ring {
+    RingPoint *points;
+    int num_points;
+} ring;
+
+uint64_t ring_hash(const char *key) {
+    //FNV-1a, then a splitmix64 finalizer so that "host:8080#1" and "host:8080#2" land far apart
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *c = key; *c != '\0'; c++) {
+        h ^= (unsigned char) *c;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+static int compare_points(const void *a, const void *b) {
+    const RingPoint *pa = (const RingPoint *) a;
+    const RingPoint *pb = (const RingPoint *) b;
+    if (pa->hash != pb->hash) {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    //Break (unlikely) ties the same way on every node
+    return pa->node - pb->node;
+}
+ring_t *ring_new(char **nodes, int num_nodes, int vnodes) {
+    if (num_nodes < 1 || vnodes < 1) {
+        return NULL;
+    }
+    ring_t *r = calloc(1, sizeof(ring_t));
+    r->num_points = num_nodes * vnodes;
+    r->points = calloc(r->num_points, sizeof(RingPoint));
+    for (int i = 0; i < num_nodes; i++) {
+        size_t name_size = strlen(nodes[i]) + 16;
+        char name[name_size];
+        for (int v = 0; v < vnodes; v++) {
+            snprintf(name, name_size, "%s#%d", nodes[i], v);
+            r->points[i * vnodes + v].hash = ring_hash(name);
+            r->points[i * vnodes + v].node = i;
+        }
+    }
+    qsort(r->points, r->num_points, sizeof(RingPoint), compare_points);
+    return r;
+}
+void ring_delete(ring_t **r) {
+    if (r != NULL && *r != NULL) {
+        free((*r)->points);
+        free(*r);
+        *r = NULL;
+    }
+}
+int ring_lookup(ring_t *r, const char *key) {
+    //The owner is the first point at or after the key's hash, wrapping around
+    uint64_t h = ring_hash(key);
+    int lo = 0;
+    int hi = r->num_points;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (r->points[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return r->points[lo == r->num_points ? 0 : lo].node;
+}
@@ -0,0 +1,52 @@
+/**
+ * @File ring.h
+ *
+ * A consistent-hash ring with virtual nodes, used by cluster mode to
+ * decide which server owns a URI.
+ *
+ * @author Brendan Lau
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/** @struct ring_t
+ *
+ *  @brief This typedef renames the struct ring.
+ */
+typedef struct ring ring_t;
+
+/** @brief Dynamically allocates and initializes a new ring.  Every node
+ *         that is given the same list of names builds the same ring.
+ *
+ *  @param nodes The names of the nodes, e.g. "localhost:8080".
+ *
+ *  @param num_nodes The number of names in nodes.
+ *
+ *  @param vnodes The number of points each node gets on the ring.
+ *
+ *  @return a pointer to a new ring_t, or NULL if num_nodes or vnodes
+ *          is less than 1.
+ */
+ring_t *ring_new(char **nodes, int num_nodes, int vnodes);
+
+/** @brief Delete your ring and free all of its memory.
+ *
+ *  @param r the ring to be deleted.  *r is set to NULL.
+ */
+void ring_delete(ring_t **r);
+
+/** @brief Find the node that owns a key.
+ *
+ *  @param r the ring to search.
+ *
+ *  @param key the key, e.g. a URI.
+ *
+ *  @return the index into the nodes array passed to ring_new.
+ */
+int ring_lookup(ring_t *r, const char *key);
+
+/** @brief The 64-bit hash used to place nodes and keys on the ring.
+ */
+uint64_t ring_hash(const char *key);
@@ -41,11 +41,14 @@ void reader_lock(rwlock_t *rw) {
     pthread_mutex_lock(&rw->lock);
     /*
     Wait if any of the following are true:
-    1. The priority is writers and there are writers
-    2. The priority is N_WAY, and there are writers OR there are more readers than the limit n OR if the read count exceeded n
+    1. There is a writer in progress
+    2. The priority is writers and a writer is waiting
+    3. The priority is N_WAY, and the read count reached n while a writer is waiting
     */
-    while ((rw->priority == WRITERS && rw->num_writers > 0)
-           || (rw->priority == N_WAY && (rw->num_writers > 0 || rw->read_count >= rw->n))) {
+    while (rw->num_writers > 0 || (rw->priority == WRITERS && rw->num_writers_waiting > 0)
+           || (rw->priority == N_WAY
+               && (rw->num_writers > 0
+                   || (rw->read_count >= rw->n && rw->num_writers_waiting > 0)))) {
         rw->num_readers_waiting++;
         pthread_cond_wait(&rw->readers_available, &rw->lock);
         rw->num_readers_waiting--;
@@ -59,7 +62,7 @@ void reader_unlock(rwlock_t *rw) {
     rw->num_readers--;
     //Broadcast readers first if priority is readers, otherwise signal to writers
     //Signal to writers first if priority is writers, otherwise broadcase to readers
-    //For N-WAY, allow readers to go first if the read count has not exceeded n, otherwise allow writers to go.
+    //For N-WAY, allow readers to go first if the read count has not exceeded n or no writer is waiting, otherwise allow writers to go.
     if (rw->priority == READERS) {
         if (rw->num_readers_waiting > 0) {
             pthread_cond_broadcast(&rw->readers_available);
@@ -73,7 +76,8 @@ void reader_unlock(rwlock_t *rw) {
             pthread_cond_broadcast(&rw->readers_available);
         }
     } else {
-        if (rw->num_readers_waiting > 0 && rw->read_count < rw->n) {
+        if (rw->num_readers_waiting > 0
+            && (rw->read_count < rw->n || rw->num_writers_waiting == 0)) {
             pthread_cond_broadcast(&rw->readers_available);
         } else if (rw->num_writers_waiting > 0) {
             pthread_cond_signal(&rw->writers_available);
@@ -85,15 +89,11 @@ void writer_lock(rwlock_t *rw) {
     pthread_mutex_lock(&rw->lock);
     /*
     Wait if any of the following are true:
-    1. The priority is readers and there are readers
-    2. The priority is N_WAY, and there are readers OR there is already a writer in progress
-    3. The priority is N_WAY, and the read count less than n (should let readers go)
+    1. There are readers or a writer in progress
+    2. The priority is N_WAY, and the read count less than n (should let readers go)
     */
-    while ((rw->priority == READERS && rw->num_readers > 0)
-           || (rw->priority == N_WAY
-               && (rw->num_readers > 0 || rw->num_writers > 0
-                   || (rw->read_count < rw->n && rw->num_readers_waiting > 0)))
-           || rw->num_writers > 0) {
+    while (rw->num_readers > 0 || rw->num_writers > 0
+           || (rw->priority == N_WAY && rw->read_count < rw->n && rw->num_readers_waiting > 0)) {
         rw->num_writers_waiting++;
         pthread_cond_wait(&rw->writers_available, &rw->lock);
         rw->num_writers_waiting--;
@@ -121,7 +121,8 @@ void writer_unlock(rwlock_t *rw) {
             pthread_cond_broadcast(&rw->readers_available);
         }
     } else {
-        if (rw->num_readers_waiting > 0 && rw->read_count < rw->n) {
+        if (rw->num_readers_waiting > 0
+            && (rw->read_count < rw->n || rw->num_writers_waiting == 0)) {
             pthread_cond_broadcast(&rw->readers_available);
         } else if (rw->num_writers_waiting > 0) {
             pthread_cond_signal(&rw->writers_available);
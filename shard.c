@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include "shard.h"
+#include "queue.h"
+
+#define MAX_NODES 64
+#define NODE_PATH "/sys/devices/system/node/node%d/%s"
+
+typedef struct Shard {
+    cpu_set_t cpus;
+    int node;
+    queue_t *queue;
+    int *steal_order; //The other shards, nearest first
+    pthread_cond_t wake;
+    int idle; //Workers waiting on wake
+    int wakeups; //Signals sent to wake that no worker has taken yet
+} Shard;
+
+static Shard *shards;
+static int num_shards;
+static bool pinning;
+static cpu_set_t original_cpus;
+static int cpu_shard[CPU_SETSIZE];
+static int node_distance[MAX_NODES][MAX_NODES];
+static atomic_int next_shard; //Used by the accepting thread and the cluster's idle thread
+//Guards every shard's idle and wakeups; push_count changes with every push, so that a worker can
+//tell whether something arrived between looking at the queues and going to sleep
+static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int push_count;
+
+static bool read_line(int node, const char *name, char *buf, int size) {
+    char path[128];
+    snprintf(path, sizeof(path), NODE_PATH, node, name);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = fgets(buf, size, file) != NULL;
+    fclose(file);
+    return ok;
+}
+//Parses a cpulist such as "0-3,8-11"
+static bool parse_cpulist(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1) {
+                return false;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return true;
+}
+//Fills sets with the usable CPUs of each NUMA node and returns how many nodes have any.  A machine
+//without /sys/devices/system/node is treated as a single node.
+static int read_nodes(cpu_set_t *sets, int *nodes) {
+    char line[4096];
+    int n = 0;
+    for (int node = 0; node < MAX_NODES; node++) {
+        if (!read_line(node, "cpulist", line, sizeof(line)) || !parse_cpulist(line, &sets[n])) {
+            continue;
+        }
+        CPU_AND(&sets[n], &sets[n], &original_cpus);
+        if (CPU_COUNT(&sets[n]) == 0) {
+            continue;
+        }
+        nodes[n++] = node;
+        if (read_line(node, "distance", line, sizeof(line))) {
+            char *p = line;
+            for (int other = 0; other < MAX_NODES; other++) {
+                char *end;
+                long distance = strtol(p, &end, 10);
+                if (end == p) {
+                    break;
+                }
+                node_distance[node][other] = distance;
+                p = end;
+            }
+        }
+    }
+    if (n == 0) {
+        sets[0] = original_cpus;
+        nodes[0] = 0;
+        n = 1;
+    }
+    return n;
+}
+static int distance(int a, int b) {
+    return node_distance[shards[a].node][shards[b].node];
+}
+//Orders the other shards by node distance, then by how close their numbers are
+static void build_steal_order(int shard) {
+    int *order = malloc((num_shards > 1 ? num_shards - 1 : 1) * sizeof(int));
+    int n = 0;
+    for (int other = 0; other < num_shards; other++) {
+        if (other == shard) {
+            continue;
+        }
+        int i = n++;
+        while (i > 0
+               && (distance(shard, order[i - 1]) > distance(shard, other)
+                   || (distance(shard, order[i - 1]) == distance(shard, other)
+                       && abs(order[i - 1] - shard) > abs(other - shard)))) {
+            order[i] = order[i - 1];
+            i--;
+        }
+        order[i] = other;
+    }
+    shards[shard].steal_order = order;
+}
+int shard_init(const char *mode, int num_threads, int queue_size) {
+    if (num_threads < 1 || sched_getaffinity(0, sizeof(original_cpus), &original_cpus) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < MAX_NODES; i++) {
+        for (int j = 0; j < MAX_NODES; j++) {
+            node_distance[i][j] = i == j ? 10 : 20;
+        }
+    }
+    cpu_set_t *sets = malloc(CPU_SETSIZE * sizeof(cpu_set_t));
+    int *nodes = malloc(CPU_SETSIZE * sizeof(int));
+    int count;
+    if (mode == NULL) {
+        sets[0] = original_cpus;
+        nodes[0] = 0;
+        count = 1;
+    } else if (strcmp(mode, "node") == 0) {
+        count = read_nodes(sets, nodes);
+    } else if (strcmp(mode, "core") == 0) {
+        cpu_set_t node_sets[MAX_NODES];
+        int node_ids[MAX_NODES];
+        int num_nodes = read_nodes(node_sets, node_ids);
+        count = 0;
+        for (int i = 0; i < num_nodes; i++) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &node_sets[i])) {
+                    CPU_ZERO(&sets[count]);
+                    CPU_SET(cpu, &sets[count]);
+                    nodes[count++] = node_ids[i];
+                }
+            }
+        }
+    } else {
+        count = 0;
+    }
+    if (count < 1) {
+        free(sets);
+        free(nodes);
+        return -1;
+    }
+    //Every shard needs a worker, so merge runs of neighbouring shards, which share a node where
+    //possible since the lists above are in node order
+    if (count > num_threads) {
+        for (int i = 0; i < num_threads; i++) {
+            int first = i * count / num_threads;
+            int last = (i + 1) * count / num_threads;
+            cpu_set_t merged = sets[first];
+            for (int j = first + 1; j < last; j++) {
+                CPU_OR(&merged, &merged, &sets[j]);
+            }
+            sets[i] = merged;
+            nodes[i] = nodes[first];
+        }
+        count = num_threads;
+    }
+    shards = calloc(count, sizeof(Shard));
+    num_shards = count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        cpu_shard[cpu] = -1;
+    }
+    for (int i = 0; i < count; i++) {
+        shards[i].cpus = sets[i];
+        shards[i].node = nodes[i];
+        shards[i].queue = queue_new(queue_size);
+        pthread_cond_init(&shards[i].wake, NULL);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &sets[i])) {
+                cpu_shard[cpu] = i;
+            }
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        build_steal_order(i);
+    }
+    free(sets);
+    free(nodes);
+    pinning = mode != NULL;
+    return count;
+}
+int shard_count(void) {
+    return num_shards;
+}
+int shard_of_thread(int thread) {
+    return thread % num_shards;
+}
+int shard_pin(int shard) {
+    if (!pinning) {
+        return 0;
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &shards[shard].cpus) == 0
+               ? 0
+               : -1;
+}
+int shard_for_socket(int socket) {
+    if (num_shards == 1) {
+        return 0;
+    }
+    int cpu;
+    socklen_t length = sizeof(cpu);
+    if (getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == 0 && cpu >= 0
+        && cpu < CPU_SETSIZE && cpu_shard[cpu] != -1) {
+        return cpu_shard[cpu];
+    }
+    return (unsigned int) atomic_fetch_add(&next_shard, 1) % num_shards;
+}
+//Wakes a waiting worker in shard, or else in the nearest shard that has one, to take the element
+//just pushed onto shard's queue
+static void wake_worker(int shard) {
+    pthread_mutex_lock(&wake_mutex);
+    push_count++;
+    for (int i = -1; i < num_shards - 1; i++) {
+        Shard *s = &shards[i < 0 ? shard : shards[shard].steal_order[i]];
+        if (s->idle > s->wakeups) {
+            s->wakeups++;
+            pthread_cond_signal(&s->wake);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wake_mutex);
+}
+void shard_push(int shard, void *elem) {
+    if (num_shards == 1) {
+        queue_push(shards[0].queue, elem);
+        return;
+    }
+    if (queue_try_push(shards[shard].queue, elem)) {
+        wake_worker(shard);
+        return;
+    }
+    for (int i = 0; i < num_shards - 1; i++) {
+        int other = shards[shard].steal_order[i];
+        if (queue_try_push(shards[other].queue, elem)) {
+            wake_worker(other);
+            return;
+        }
+    }
+    queue_push(shards[shard].queue, elem);
+    wake_worker(shard);
+}
+void *shard_pop(int shard) {
+    void *elem = NULL;
+    if (num_shards == 1) {
+        queue_pop(shards[0].queue, &elem);
+        return elem;
+    }
+    Shard *s = &shards[shard];
+    while (1) {
+        pthread_mutex_lock(&wake_mutex);
+        unsigned int seen = push_count;
+        pthread_mutex_unlock(&wake_mutex);
+        if (queue_pop_timeout(s->queue, &elem, 0)) {
+            return elem;
+        }
+        for (int i = 0; i < num_shards - 1; i++) {
+            if (queue_pop_timeout(shards[s->steal_order[i]].queue, &elem, 0)) {
+                return elem;
+            }
+        }
+        pthread_mutex_lock(&wake_mutex);
+        if (push_count == seen) {
+            s->idle++;
+            while (s->wakeups == 0) {
+                pthread_cond_wait(&s->wake, &wake_mutex);
+            }
+            s->wakeups--;
+            s->idle--;
+        }
+        pthread_mutex_unlock(&wake_mutex);
+    }
+}
@@ -0,0 +1,68 @@
+/**
+ * @File shard.h
+ *
+ * Splits the worker threads into shards, one per NUMA node or one per
+ * core.  Each shard has its own connection queue and its threads are
+ * pinned to its CPUs.  New connections go to the shard whose CPU
+ * received them (SO_INCOMING_CPU), and a worker whose queue is empty
+ * takes connections from other shards, nearest first.  Without a mode,
+ * there is a single shard and nothing is pinned.
+ *
+ * @author Brendan Lau
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/** @brief Reads the machine's topology and creates the shards and their
+ *         queues.  If there are more shards than threads, neighbouring
+ *         shards are merged.
+ *
+ *  @param mode "node", "core", or NULL for a single unpinned shard.
+ *
+ *  @param num_threads The number of worker threads.
+ *
+ *  @param queue_size The capacity of each shard's queue.
+ *
+ *  @return The number of shards, or -1 if mode is invalid or the
+ *          topology can't be read.
+ */
+int shard_init(const char *mode, int num_threads, int queue_size);
+
+/** @brief The number of shards created by shard_init.
+ */
+int shard_count(void);
+
+/** @brief The shard worker thread i belongs to.  Threads are dealt out
+ *         to the shards in turn.
+ */
+int shard_of_thread(int thread);
+
+/** @brief Restricts the calling thread to the shard's CPUs, so that
+ *         memory it touches first is placed on the shard's node.  Does
+ *         nothing without a mode.
+ *
+ *  @return 0, indicating success, or -1, indicating that it failed.
+ */
+int shard_pin(int shard);
+
+/** @brief Picks the shard for a new connection: the one that owns the
+ *         CPU that received it, or the next shard in turn if that is
+ *         unknown.
+ */
+int shard_for_socket(int socket);
+
+/** @brief Queues elem on shard.  If its queue is full, elem goes to the
+ *         nearest shard with room, and only if every queue is full does
+ *         this wait.  Then wakes a waiting worker in the shard elem went
+ *         to, or if it has none, in the nearest shard that does.
+ */
+void shard_push(int shard, void *elem);
+
+/** @brief Takes the next element for a worker in shard, from its own
+ *         queue if possible and otherwise from the nearest shard that
+ *         has one.  If every queue is empty, sleeps until shard_push
+ *         wakes it.
+ */
+void *shard_pop(int shard);
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "storage.h"
+#include "helper_funcs.h"
+
+static int file_open(const char *URI, StoredObject *object, int *status_code) {
+    int fd = open(URI, O_RDONLY);
+    if (fd == -1) {
+        *status_code = 404;
+        return -1;
+    }
+    char testbuf[1];
+    if (read(fd, testbuf, 1) == -1) { //Try reading to see if valid file
+        close(fd);
+        *status_code = 403;
+        return -1;
+    }
+    object->fd = fd;
+    object->offset = 0;
+    object->length = lseek(fd, 0, SEEK_END);
+    object->handle = NULL;
+    *status_code = 200;
+    return 0;
+}
+static void file_close(StoredObject *object) {
+    close(object->fd);
+}
+static int file_put(const char *URI, char *body, size_t body_length, int socket,
+    size_t content_length, int *status_code) {
+    *status_code = 200;
+    int fd = open(URI, O_WRONLY | O_TRUNC, 0);
+    if (fd == -1) {
+        *status_code = 201;
+        fd = creat(URI, 0666);
+        if (fd == -1) {
+            *status_code = 500;
+            return -1;
+        }
+    }
+    //Need to write remainder bytes after parsing header fields
+    if (body_length > content_length) {
+        body_length = content_length;
+    }
+    ssize_t bytes_written = write_n_bytes(fd, body, body_length);
+    if (bytes_written == -1) {
+        //The rest of the body is left unread, so the caller must not reuse the connection
+        close(fd);
+        *status_code = 500;
+        return -1;
+    }
+    if ((size_t) bytes_written < content_length) {
+        pass_n_bytes(socket, fd, content_length - bytes_written);
+    }
+    close(fd);
+    return 0;
+}
+static int file_remove(const char *URI, int *status_code) {
+    if (unlink(URI) == -1) {
+        *status_code = errno == ENOENT ? 404 : 500;
+        return -1;
+    }
+    *status_code = 200;
+    return 0;
+}
+
+StorageBackend file_storage = { file_open, file_close, file_put, file_remove };
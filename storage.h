@@ -0,0 +1,68 @@
+/**
+ * @File storage.h
+ *
+ * The interface between the request handlers and wherever objects are
+ * kept.  file_storage keeps each URI in its own file in the working
+ * directory; logstore.h provides a backend for small objects.
+ *
+ * @author Brendan Lau
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/** @struct StoredObject
+ *
+ *  @brief An object opened for reading.  The body is the length bytes
+ *         of fd starting at offset.  Send it with pread or
+ *         pass_n_bytes_at, since fd may be shared between threads.
+ */
+typedef struct StoredObject {
+    int fd;
+    off_t offset;
+    size_t length;
+    void *handle;
+} StoredObject;
+
+/** @struct StorageBackend
+ *
+ *  @brief The operations a backend provides.  The caller already holds
+ *         the URI's file lock: a reader lock around open/close and a
+ *         writer lock around put and remove.
+ */
+typedef struct StorageBackend {
+    /** @brief Opens URI for reading.
+     *
+     *  @return 0, and sets status_code to 200, or -1, and sets
+     *          status_code to 404 or 403.
+     */
+    int (*open)(const char *URI, StoredObject *object, int *status_code);
+
+    /** @brief Releases an object returned by open.
+     */
+    void (*close)(StoredObject *object);
+
+    /** @brief Stores content_length bytes as URI.  The first
+     *         body_length bytes are in body; the rest are read from
+     *         socket.
+     *
+     *  @return 0, and sets status_code to 200 or 201, or -1, and sets
+     *          status_code to 500.  After -1, part of the body may still
+     *          be unread on socket.
+     */
+    int (*put)(const char *URI, char *body, size_t body_length, int socket,
+        size_t content_length, int *status_code);
+
+    /** @brief Deletes URI.
+     *
+     *  @return 0, and sets status_code to 200, or -1, and sets
+     *          status_code to 404 or 500.
+     */
+    int (*remove)(const char *URI, int *status_code);
+} StorageBackend;
+
+/** @brief One regular file per URI.
+ */
+extern StorageBackend file_storage;
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "trace.h"
+
+#define TRACE_RING_SIZE 4096
+#define TRACE_FIELD_SIZE 64
+
+static const char *span_names[SPAN_COUNT]
+    = { "queue_wait", "read", "parse", "lock_wait", "disk_io", "send" };
+
+//One Chrome "complete" event.  kind == SPAN_COUNT marks the enclosing request event.
+typedef struct TraceEvent {
+    uint64_t start;
+    uint64_t end;
+    int kind;
+    int status_code;
+    uint64_t seq;
+    uint64_t syscalls;
+    char method[9];
+    char URI[TRACE_FIELD_SIZE];
+    char request_id[12];
+} TraceEvent;
+typedef struct TraceRing {
+    pthread_mutex_t mutex;
+    TraceEvent *events;
+    uint64_t next;
+    //State of the request in progress, only touched by the owning thread
+    uint64_t request_start;
+    uint64_t span_start[SPAN_COUNT];
+    uint64_t span_end[SPAN_COUNT];
+    uint64_t seq;
+    uint32_t rand_state;
+} TraceRing;
+
+bool trace_enabled = false;
+static TraceRing *rings;
+static int num_rings;
+static atomic_int next_ring;
+static const char *trace_path;
+static double trace_rate;
+static uint64_t trace_threshold;
+static _Thread_local TraceRing *my_ring;
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+static void *trace_signal_thread(void *arg) {
+    sigset_t *set = (sigset_t *) arg;
+    int sig;
+    while (1) {
+        if (sigwait(set, &sig) == 0 && trace_dump() == -1) {
+            fprintf(stderr, "Failed to write trace to %s\n", trace_path);
+        }
+    }
+    return NULL;
+}
+int trace_init(const char *path, double sample_rate, uint64_t threshold_us, int num_threads) {
+    static sigset_t set;
+    pthread_t thread;
+    rings = calloc(num_threads, sizeof(TraceRing));
+    if (rings == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&rings[i].mutex, NULL);
+        rings[i].events = calloc(TRACE_RING_SIZE, sizeof(TraceEvent));
+        if (rings[i].events == NULL) {
+            return -1;
+        }
+        rings[i].rand_state = 2463534242u + i;
+    }
+    num_rings = num_threads;
+    trace_path = path;
+    trace_rate = sample_rate;
+    trace_threshold = threshold_us * 1000;
+    //Workers inherit the mask, so only the signal thread ever sees SIGUSR1
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0
+        || pthread_create(&thread, NULL, trace_signal_thread, &set) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    trace_enabled = true;
+    return 0;
+}
+void trace_thread_init(void) {
+    if (trace_enabled) {
+        int index = atomic_fetch_add(&next_ring, 1);
+        my_ring = index < num_rings ? &rings[index] : NULL;
+    }
+}
+void trace_request_begin(uint64_t start) {
+    TraceRing *ring = my_ring;
+    if (ring != NULL) {
+        ring->request_start = start;
+        memset(ring->span_start, 0, sizeof(ring->span_start));
+        memset(ring->span_end, 0, sizeof(ring->span_end));
+    }
+}
+void trace_span(SPAN span, uint64_t start, uint64_t end) {
+    TraceRing *ring = my_ring;
+    if (ring != NULL) {
+        ring->span_start[span] = start;
+        ring->span_end[span] = end;
+    }
+}
+static bool sampled(TraceRing *ring, uint64_t duration) {
+    if (trace_threshold > 0 && duration >= trace_threshold) {
+        return true;
+    }
+    if (trace_rate >= 1.0) {
+        return true;
+    }
+    //xorshift32; rand() would serialize the workers on its internal lock
+    ring->rand_state ^= ring->rand_state << 13;
+    ring->rand_state ^= ring->rand_state >> 17;
+    ring->rand_state ^= ring->rand_state << 5;
+    return ring->rand_state < trace_rate * UINT32_MAX;
+}
+static void push_event(TraceRing *ring, TraceEvent *event) {
+    ring->events[ring->next % TRACE_RING_SIZE] = *event;
+    ring->next++;
+}
+void trace_request_end(const char *method, const char *URI, const char *request_id,
+    int status_code, uint64_t syscalls) {
+    TraceRing *ring = my_ring;
+    if (ring == NULL) {
+        return;
+    }
+    TraceEvent event;
+    event.start = ring->request_start;
+    event.end = trace_now();
+    if (!sampled(ring, event.end - event.start)) {
+        return;
+    }
+    event.kind = SPAN_COUNT;
+    event.status_code = status_code;
+    event.seq = ring->seq++;
+    event.syscalls = syscalls;
+    snprintf(event.method, sizeof(event.method), "%s", method != NULL ? method : "");
+    snprintf(event.URI, sizeof(event.URI), "%s", URI != NULL ? URI : "");
+    snprintf(
+        event.request_id, sizeof(event.request_id), "%s", request_id != NULL ? request_id : "");
+    pthread_mutex_lock(&ring->mutex);
+    push_event(ring, &event);
+    for (int i = 0; i < SPAN_COUNT; i++) {
+        if (ring->span_end[i] != 0) {
+            event.kind = i;
+            event.start = ring->span_start[i];
+            event.end = ring->span_end[i];
+            push_event(ring, &event);
+        }
+    }
+    pthread_mutex_unlock(&ring->mutex);
+}
+static void write_event(FILE *file, TraceEvent *event, int tid, bool first) {
+    //Method, URI and Request-Id are validated by parseRequest, so nothing needs escaping
+    fprintf(file,
+        "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"method\":\"%s\",\"uri\":\"%s\","
+        "\"request_id\":\"%s\",\"status\":%d,\"seq\":%lu,\"syscalls\":%lu}}",
+        first ? "" : ",", event->kind == SPAN_COUNT ? "request" : span_names[event->kind],
+        event->kind == SPAN_COUNT ? "request" : "span", (int) getpid(), tid, event->start / 1000.0,
+        (event->end - event->start) / 1000.0, event->method, event->URI, event->request_id,
+        event->status_code, (unsigned long) event->seq, (unsigned long) event->syscalls);
+}
+int trace_dump(void) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", trace_path);
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    TraceEvent *events = malloc(TRACE_RING_SIZE * sizeof(TraceEvent));
+    bool first = true;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (int i = 0; i < num_rings && events != NULL; i++) {
+        //Copy out under the lock so the worker is only held up for a memcpy
+        pthread_mutex_lock(&rings[i].mutex);
+        uint64_t next = rings[i].next;
+        uint64_t count = next < TRACE_RING_SIZE ? next : TRACE_RING_SIZE;
+        for (uint64_t j = 0; j < count; j++) {
+            events[j] = rings[i].events[(next - count + j) % TRACE_RING_SIZE];
+        }
+        pthread_mutex_unlock(&rings[i].mutex);
+        for (uint64_t j = 0; j < count; j++) {
+            write_event(file, &events[j], i, first);
+            first = false;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    free(events);
+    if (fclose(file) != 0 || rename(tmp_path, trace_path) != 0) {
+        return -1;
+    }
+    return 0;
+}
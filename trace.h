@@ -0,0 +1,92 @@
+/**
+ * @File trace.h
+ *
+ * Optional per-request tracing.  Each worker thread records timestamped
+ * spans into its own ring buffer; the rings are dumped as Chrome
+ * trace-event JSON (loadable in chrome://tracing or ui.perfetto.dev)
+ * whenever the server receives SIGUSR1.
+ *
+ * @author Brendan Lau
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** @brief The phases of a request that get their own span.
+ */
+typedef enum {
+    SPAN_QUEUE_WAIT,
+    SPAN_READ,
+    SPAN_PARSE,
+    SPAN_LOCK_WAIT,
+    SPAN_DISK_IO,
+    SPAN_SEND,
+    SPAN_COUNT
+} SPAN;
+
+/** @brief Set by trace_init.  Checked by the macros below so that a
+ *         server running without tracing never reads the clock.
+ */
+extern bool trace_enabled;
+
+#define TRACE_NOW() (trace_enabled ? trace_now() : 0)
+#define TRACE_SPAN(span, start)                                                                    \
+    do {                                                                                           \
+        if (trace_enabled) {                                                                       \
+            trace_span((span), (start), trace_now());                                              \
+        }                                                                                          \
+    } while (0)
+
+/** @brief Enables tracing and starts the thread that waits for
+ *         SIGUSR1.  Every other thread must have SIGUSR1 blocked, so the
+ *         caller blocks it before creating any thread, including those
+ *         started by other _init functions.
+ *
+ *  @param path The file the trace is written to on every SIGUSR1.
+ *
+ *  @param sample_rate The fraction of requests (0 to 1) kept at random.
+ *
+ *  @param threshold_us Requests that take at least this many
+ *         microseconds are always kept; 0 disables the threshold.
+ *
+ *  @param num_threads The number of worker threads that will call
+ *         trace_thread_init.
+ *
+ *  @return 0, indicating success, or -1, indicating that it failed.
+ */
+int trace_init(const char *path, double sample_rate, uint64_t threshold_us, int num_threads);
+
+/** @brief Claims a ring buffer for the calling worker thread.
+ */
+void trace_thread_init(void);
+
+/** @brief Returns the monotonic clock in nanoseconds.
+ */
+uint64_t trace_now(void);
+
+/** @brief Starts a new request on the calling thread.
+ *
+ *  @param start The time the connection was accepted.
+ */
+void trace_request_begin(uint64_t start);
+
+/** @brief Records one span of the current request.
+ */
+void trace_span(SPAN span, uint64_t start, uint64_t end);
+
+/** @brief Finishes the current request and, if it is sampled, copies
+ *         its spans into the calling thread's ring buffer.
+ *
+ *  @param syscalls The number of I/O syscalls the request made, as
+ *         counted by io_syscall_count.
+ */
+void trace_request_end(const char *method, const char *URI, const char *request_id,
+    int status_code, uint64_t syscalls);
+
+/** @brief Writes every ring buffer to the trace file.
+ *
+ *  @return 0, indicating success, or -1, indicating that it failed.
+ */
+int trace_dump(void);